@@ -175,8 +175,10 @@ HEADERS += src/qt/bitcoingui.h \
     src/walletdb.h \
     src/script.h \
     src/init.h \
+    src/blockview.h \
     src/bloom.h \
     src/mruset.h \
+    src/notifier.h \
     src/checkqueue.h \
     src/json/json_spirit_writer_template.h \
     src/json/json_spirit_writer.h \
@@ -263,6 +265,7 @@ SOURCES += src/qt/bitcoin.cpp \
     src/main.cpp \
     src/init.cpp \
     src/net.cpp \
+    src/blockview.cpp \
     src/bloom.cpp \
     src/checkpoints.cpp \
     src/addrman.cpp \
@@ -294,6 +297,8 @@ SOURCES += src/qt/bitcoin.cpp \
     src/rpcminting.cpp \
     src/rpcwallet.cpp \
     src/rpcblockchain.cpp \
+    src/notifier.cpp \
+    src/rest.cpp \
     src/rpcrawtransaction.cpp \
     src/qt/overviewpage.cpp \
     src/qt/csvmodelwriter.cpp \
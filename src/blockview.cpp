@@ -0,0 +1,249 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockview.h"
+
+using namespace std;
+
+uint256 CTxInView::GetPrevHash() const
+{
+    uint256 hash;
+    memcpy(&hash, pprevout, sizeof(hash));
+    return hash;
+}
+
+unsigned int CTxInView::GetPrevN() const
+{
+    unsigned int n;
+    memcpy(&n, pprevout + sizeof(uint256), sizeof(n));
+    return n;
+}
+
+bool CTransactionView::GetTransaction(CTransaction& tx) const
+{
+    try {
+        CDataStream ss((const char*)data.begin(), (const char*)data.end(), SER_DISK, CLIENT_VERSION);
+        ss >> tx;
+    }
+    catch (std::exception &e) {
+        return false;
+    }
+    return true;
+}
+
+// Reads serialized data in place, with the same rules as CDataStream
+class CBlockViewReader
+{
+public:
+    const unsigned char* p;
+    const unsigned char* pend;
+
+    CBlockViewReader(const unsigned char* pbegin, const unsigned char* pendIn) : p(pbegin), pend(pendIn) {}
+
+    bool Skip(unsigned int nSize)
+    {
+        if ((unsigned int)(pend - p) < nSize)
+            return false;
+        p += nSize;
+        return true;
+    }
+
+    template<typename T>
+    bool Read(T& obj)
+    {
+        if ((unsigned int)(pend - p) < sizeof(obj))
+            return false;
+        memcpy(&obj, p, sizeof(obj));
+        p += sizeof(obj);
+        return true;
+    }
+
+    // See ReadCompactSize in serialize.h
+    bool ReadCompactSize(uint64& nSize)
+    {
+        unsigned char chSize;
+        if (!Read(chSize))
+            return false;
+        if (chSize < 253)
+            nSize = chSize;
+        else if (chSize == 253)
+        {
+            unsigned short xSize;
+            if (!Read(xSize))
+                return false;
+            nSize = xSize;
+        }
+        else if (chSize == 254)
+        {
+            unsigned int xSize;
+            if (!Read(xSize))
+                return false;
+            nSize = xSize;
+        }
+        else if (!Read(nSize))
+            return false;
+        return nSize <= (uint64)MAX_SIZE;
+    }
+
+    bool ReadSpan(CByteSpan& span)
+    {
+        uint64 nSize;
+        if (!ReadCompactSize(nSize) || (uint64)(pend - p) < nSize)
+            return false;
+        span = CByteSpan(p, p + nSize);
+        p += nSize;
+        return true;
+    }
+};
+
+CBlockView::CBlockView(const CBlockView& view) : vchData(view.vchData)
+{
+    if (!Parse())
+        SetNull();
+}
+
+CBlockView& CBlockView::operator=(const CBlockView& view)
+{
+    if (this != &view)
+    {
+        vchData = view.vchData;
+        if (!Parse())
+            SetNull();
+    }
+    return *this;
+}
+
+void CBlockView::SetNull()
+{
+    vchData.clear();
+    vin.clear();
+    vout.clear();
+    header.SetNull();
+    vtx.clear();
+    vchBlockSig = CByteSpan();
+}
+
+bool CBlockView::Parse(std::vector<unsigned char>& vchBlock)
+{
+    vchData.swap(vchBlock);
+    vchBlock.clear();
+    if (!Parse())
+    {
+        SetNull();
+        return false;
+    }
+    return true;
+}
+
+bool CBlockView::Parse()
+{
+    vin.clear();
+    vout.clear();
+    vtx.clear();
+    if (vchData.empty())
+        return false;
+    CBlockViewReader reader(&vchData[0], &vchData[0] + vchData.size());
+
+    if (!reader.Read(header.nVersion) || !reader.Read(header.hashPrevBlock) || !reader.Read(header.hashMerkleRoot) ||
+        !reader.Read(header.nTime) || !reader.Read(header.nBits) || !reader.Read(header.nNonce))
+        return false;
+
+    // Inputs and outputs are found by their index until all are parsed
+    uint64 nTx;
+    if (!reader.ReadCompactSize(nTx))
+        return false;
+    vector<pair<unsigned int, unsigned int> > vFirst;
+    for (uint64 i = 0; i < nTx; i++)
+    {
+        CTransactionView tx;
+        const unsigned char* pbeginTx = reader.p;
+        vFirst.push_back(make_pair(vin.size(), vout.size()));
+
+        uint64 nIns;
+        if (!reader.Read(tx.nVersion) || !reader.Read(tx.nTime) || !reader.ReadCompactSize(nIns))
+            return false;
+        for (uint64 j = 0; j < nIns; j++)
+        {
+            CTxInView txin;
+            txin.pprevout = reader.p;
+            if (!reader.Skip(sizeof(uint256) + sizeof(unsigned int)) || !reader.ReadSpan(txin.scriptSig) || !reader.Read(txin.nSequence))
+                return false;
+            vin.push_back(txin);
+        }
+
+        uint64 nOuts;
+        if (!reader.ReadCompactSize(nOuts))
+            return false;
+        for (uint64 j = 0; j < nOuts; j++)
+        {
+            CTxOutView txout;
+            if (!reader.Read(txout.nValue) || !reader.ReadSpan(txout.scriptPubKey))
+                return false;
+            vout.push_back(txout);
+        }
+
+        if (!reader.Read(tx.nLockTime))
+            return false;
+        tx.data = CByteSpan(pbeginTx, reader.p);
+        tx.nIns = nIns;
+        tx.nOuts = nOuts;
+        vtx.push_back(tx);
+    }
+    if (!reader.ReadSpan(vchBlockSig) || reader.p != reader.pend)
+        return false;
+
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        vtx[i].pvin = vtx[i].nIns ? &vin[vFirst[i].first] : NULL;
+        vtx[i].pvout = vtx[i].nOuts ? &vout[vFirst[i].second] : NULL;
+    }
+    return true;
+}
+
+bool CBlockView::ReadFromDisk(const CBlockIndex* pindex)
+{
+    SetNull();
+
+    // The block is preceded by its size, see CBlock::WriteToDisk
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    unsigned int nSize = 0;
+    CAutoFile filein = CAutoFile(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - sizeof(nSize)), true), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("CBlockView::ReadFromDisk() : OpenBlockFile failed");
+    try {
+        filein >> nSize;
+    }
+    catch (std::exception &e) {
+        return error("CBlockView::ReadFromDisk() : I/O error");
+    }
+    if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+        return error("CBlockView::ReadFromDisk() : invalid block size %u", nSize);
+
+    vector<unsigned char> vchBlock(nSize);
+    if (fread(&vchBlock[0], 1, nSize, filein) != nSize)
+        return error("CBlockView::ReadFromDisk() : I/O error");
+    if (!Parse(vchBlock))
+        return error("CBlockView::ReadFromDisk() : invalid block %s", pindex->GetBlockHash().ToString().c_str());
+    if (header.GetHash() != pindex->GetBlockHash())
+    {
+        SetNull();
+        return error("CBlockView::ReadFromDisk() : block hash mismatch");
+    }
+    return true;
+}
+
+bool CBlockView::GetBlock(CBlock& block) const
+{
+    block.SetNull();
+    if (vchData.empty())
+        return false;
+    try {
+        CDataStream ss(vchData, SER_DISK, CLIENT_VERSION);
+        ss >> block;
+    }
+    catch (std::exception &e) {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,114 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKVIEW_H
+#define BITCOIN_BLOCKVIEW_H
+
+#include "main.h"
+
+#include <vector>
+
+/** Bytes inside the buffer of a CBlockView, such as a script */
+class CByteSpan
+{
+public:
+    const unsigned char* pbegin;
+    const unsigned char* pend;
+
+    CByteSpan() : pbegin(NULL), pend(NULL) {}
+    CByteSpan(const unsigned char* pbeginIn, const unsigned char* pendIn) : pbegin(pbeginIn), pend(pendIn) {}
+
+    const unsigned char* begin() const { return pbegin; }
+    const unsigned char* end() const { return pend; }
+    unsigned int size() const { return pend - pbegin; }
+    bool empty() const { return pbegin == pend; }
+
+    CScript ToScript() const { return CScript(pbegin, pend); }
+};
+
+class CTxInView
+{
+public:
+    const unsigned char* pprevout; // serialized COutPoint: hash, then index
+    CByteSpan scriptSig;
+    unsigned int nSequence;
+
+    uint256 GetPrevHash() const;
+    unsigned int GetPrevN() const;
+    COutPoint GetPrevout() const { return COutPoint(GetPrevHash(), GetPrevN()); }
+    bool IsPrevoutNull() const { return GetPrevN() == (unsigned int)-1 && GetPrevHash() == 0; }
+};
+
+class CTxOutView
+{
+public:
+    int64 nValue;
+    CByteSpan scriptPubKey;
+
+    bool IsEmpty() const { return nValue == 0 && scriptPubKey.empty(); }
+};
+
+class CTransactionView
+{
+public:
+    CByteSpan data; // the serialized transaction
+    int nVersion;
+    unsigned int nTime;
+    const CTxInView* pvin;
+    unsigned int nIns;
+    const CTxOutView* pvout;
+    unsigned int nOuts;
+    unsigned int nLockTime;
+
+    // Same as CTransaction::GetHash, from the serialized transaction
+    uint256 GetHash() const { return Hash(data.begin(), data.end()); }
+
+    bool IsCoinBase() const
+    {
+        return (nIns == 1 && pvin[0].IsPrevoutNull() && nOuts >= 1);
+    }
+
+    bool IsCoinStake() const
+    {
+        return (nIns > 0 && !pvin[0].IsPrevoutNull() && nOuts >= 2 && pvout[0].IsEmpty());
+    }
+
+    bool GetTransaction(CTransaction& tx) const;
+};
+
+/**
+ * Read-only view of a serialized block, for code that only looks at some
+ * of its transactions. Parsing checks that the data is exactly one block
+ * and records where each transaction, input, output and script is, but
+ * copies none of them: the views point into the buffer of the CBlockView,
+ * and are valid until it is parsed again or destroyed. GetBlock and
+ * GetTransaction deserialize the owning objects when they are needed.
+ */
+class CBlockView
+{
+private:
+    std::vector<unsigned char> vchData;
+    std::vector<CTxInView> vin;
+    std::vector<CTxOutView> vout;
+
+    bool Parse();
+
+public:
+    CBlockHeader header;
+    std::vector<CTransactionView> vtx;
+    CByteSpan vchBlockSig;
+
+    CBlockView() {}
+    CBlockView(const CBlockView& view);
+    CBlockView& operator=(const CBlockView& view);
+
+    // Takes over the contents of vchBlock, which is left empty
+    bool Parse(std::vector<unsigned char>& vchBlock);
+    bool ReadFromDisk(const CBlockIndex* pindex);
+    void SetNull();
+
+    const std::vector<unsigned char>& GetData() const { return vchData; }
+    bool GetBlock(CBlock& block) const;
+};
+
+#endif
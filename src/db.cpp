@@ -48,6 +48,7 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 {
     fDbEnvInit = false;
     fMockDb = false;
+    nBackups = 0;
 }
 
 CDBEnv::~CDBEnv()
@@ -209,6 +210,39 @@ bool CDBEnv::Salvage(std::string strFile, bool fAggressive,
 }
 
 
+void CDBEnv::Checkpoint()
+{
+    dbenv.txn_checkpoint(0, 0, 0);
+}
+
+void CDBEnv::BeginBackup(const std::string& strFile)
+{
+    LOCK(cs_backup);
+    mapBackupDirty[strFile].clear();
+    nBackups = mapBackupDirty.size();
+}
+
+void CDBEnv::EndBackup(const std::string& strFile, std::set<std::vector<unsigned char> >& setKeysRet)
+{
+    LOCK(cs_backup);
+    setKeysRet.clear();
+    std::map<std::string, std::set<std::vector<unsigned char> > >::iterator mi = mapBackupDirty.find(strFile);
+    if (mi != mapBackupDirty.end())
+    {
+        setKeysRet.swap(mi->second);
+        mapBackupDirty.erase(mi);
+    }
+    nBackups = mapBackupDirty.size();
+}
+
+void CDBEnv::NoteWrite(const std::string& strFile, const CSecureDataStream& ssKey)
+{
+    LOCK(cs_backup);
+    std::map<std::string, std::set<std::vector<unsigned char> > >::iterator mi = mapBackupDirty.find(strFile);
+    if (mi != mapBackupDirty.end())
+        mi->second.insert(std::vector<unsigned char>(ssKey.begin(), ssKey.end()));
+}
+
 void CDBEnv::CheckpointLSN(std::string strFile)
 {
     dbenv.txn_checkpoint(0, 0, 0);
@@ -371,8 +405,8 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                     if (pcursor)
                         while (fSuccess)
                         {
-                            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-                            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+                            CSecureDataStream ssKey(SER_DISK, CLIENT_VERSION);
+                            CSecureDataStream ssValue(SER_DISK, CLIENT_VERSION);
                             int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
                             if (ret == DB_NOTFOUND)
                             {
@@ -9,6 +9,7 @@
 #include "main.h"
 
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -26,7 +27,7 @@ class CWalletTx;
 extern unsigned int nWalletDBUpdated;
 
 void ThreadFlushWalletDB(const std::string& strWalletFile);
-bool BackupWallet(const CWallet& wallet, const std::string& strDest);
+bool BackupWallet(CWallet& wallet, const std::string& strDest);
 
 
 class CDBEnv
@@ -44,6 +45,11 @@ public:
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
 
+    // keys written to files that are being backed up, see BeginBackup()
+    CCriticalSection cs_backup;
+    std::map<std::string, std::set<std::vector<unsigned char> > > mapBackupDirty;
+    volatile int nBackups;
+
     CDBEnv();
     ~CDBEnv();
     void MakeMock();
@@ -70,8 +76,14 @@ public:
     bool Open(const boost::filesystem::path &path);
     void Close();
     void Flush(bool fShutdown);
+    void Checkpoint();
     void CheckpointLSN(std::string strFile);
 
+    // Track the keys written to strFile until EndBackup() returns them
+    void BeginBackup(const std::string& strFile);
+    void EndBackup(const std::string& strFile, std::set<std::vector<unsigned char> >& setKeysRet);
+    void NoteWrite(const std::string& strFile, const CSecureDataStream& ssKey);
+
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
@@ -114,7 +126,7 @@ protected:
             return false;
 
         // Key
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CSecureDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
         Dbt datKey(&ssKey[0], ssKey.size());
@@ -129,7 +141,7 @@ protected:
 
         // Unserialize value
         try {
-            CDataStream ssValue((char*)datValue.get_data(), (char*)datValue.get_data() + datValue.get_size(), SER_DISK, CLIENT_VERSION);
+            CSecureDataStream ssValue((char*)datValue.get_data(), (char*)datValue.get_data() + datValue.get_size(), SER_DISK, CLIENT_VERSION);
             ssValue >> value;
         }
         catch (std::exception &e) {
@@ -151,19 +163,21 @@ protected:
             assert(!"Write called on database in read-only mode");
 
         // Key
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CSecureDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        CSecureDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
         int ret = pdb->put(activeTxn, &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
+        if (ret == 0 && bitdb.nBackups)
+            bitdb.NoteWrite(strFile, ssKey);
 
         // Clear memory in case it was a private key
         memset(datKey.get_data(), 0, datKey.get_size());
@@ -180,13 +194,15 @@ protected:
             assert(!"Erase called on database in read-only mode");
 
         // Key
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CSecureDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
         int ret = pdb->del(activeTxn, &datKey, 0);
+        if (ret == 0 && bitdb.nBackups)
+            bitdb.NoteWrite(strFile, ssKey);
 
         // Clear memory
         memset(datKey.get_data(), 0, datKey.get_size());
@@ -200,7 +216,7 @@ protected:
             return false;
 
         // Key
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CSecureDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
         Dbt datKey(&ssKey[0], ssKey.size());
@@ -224,7 +240,7 @@ protected:
         return pcursor;
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
+    int ReadAtCursor(Dbc* pcursor, CSecureDataStream& ssKey, CSecureDataStream& ssValue, unsigned int fFlags=DB_NEXT)
     {
         // Read at cursor
         Dbt datKey;
@@ -62,6 +62,42 @@ public:
     }
 };
 
+/** Collects a fixed-layout preimage of at most nCapacity bytes in a buffer
+ * on the stack, and hashes it like Hash(ss.begin(), ss.end()) on a
+ * CDataStream with the same contents. Writing more than nCapacity bytes is
+ * a programming error.
+ */
+template<unsigned int nCapacity>
+class CFixedHashWriter
+{
+private:
+    char pch[nCapacity];
+    unsigned int nSize;
+
+public:
+    int nType;
+    int nVersion;
+
+    CFixedHashWriter(int nTypeIn, int nVersionIn) : nSize(0), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    CFixedHashWriter& write(const char *pchIn, size_t size) {
+        assert(size <= nCapacity - nSize);
+        memcpy(pch + nSize, pchIn, size);
+        nSize += size;
+        return (*this);
+    }
+
+    uint256 GetHash() const {
+        return Hash(pch, pch + nSize);
+    }
+
+    template<typename T>
+    CFixedHashWriter& operator<<(const T& obj) {
+        // Serialize to this stream
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
 
 template<typename T1, typename T2>
 inline uint256 Hash(const T1 p1begin, const T1 p1end,
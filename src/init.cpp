@@ -17,6 +17,7 @@
 #include "util.h"
 #include "ui_interface.h"
 #include "checkpointsync.h"
+#include "notifier.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -108,6 +109,7 @@ void Shutdown()
     StopRPCThreads();
     bitdb.Flush(false);
     StopNode();
+    StopPubNotify();
     {
         LOCK(cs_main);
         if (pwalletMain)
@@ -125,6 +127,7 @@ void Shutdown()
     UnregisterWallet(pwalletMain);
     delete pwalletMain;
     printf("Shutdown : done\n");
+    StopDebugLogWriter();
 }
 
 //
@@ -221,6 +224,8 @@ std::string HelpMessage(HelpMessageMode hmm)
     }
     strUsage +=  
         "  -logtimestamps         " + _("Prepend debug output with timestamp (default: 1)") + "\n" +
+        "  -lockprofile           " + _("Record how long each lock site waits for and holds its lock, see getlockstats") + "\n" +
+        "  -asynclog              " + _("Write debug.log from a background thread (default: 1)") + "\n" +
         "  -shrinkdebugfile       " + _("Shrink debug.log file on client startup (default: 1 when no -debug)") + "\n" +
         "  -printtoconsole        " + _("Send trace/debug info to console instead of debug.log file") + "\n" +
         "  -regtest               " + _("Enter regression test mode, which uses a special chain in which blocks can be "
@@ -245,8 +250,14 @@ std::string HelpMessage(HelpMessageMode hmm)
     }
         strUsage +=
         "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n" +
+        "  -rpcworkqueue=<n>      " + _("Set the number of RPC requests that can wait for a thread, others are refused (default: 16)") + "\n" +
+        "  -rpcmaxconnections=<n> " + _("Maximum number of open RPC connections, others are refused (default: 64)") + "\n" +
+        "  -rpcreadtimeout=<n>    " + _("Close RPC connections that do not send a complete request within <n> seconds (default: 30)") + "\n" +
+        "  -rpcslowcall=<n>       " + _("Log RPC calls that take longer than <n> milliseconds (default: 0, off)") + "\n" +
+        "  -rest                  " + _("Accept public REST requests for blocks, headers, transactions and unspent outputs (default: 0)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
+        "  -pubnotify=<port>      " + _("Publish new blocks and memory pool transactions to subscribers on 127.0.0.1:<port>") + "\n" +
         "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received (%s in cmd is replaced by message)") + "\n" +
         "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n" +
         "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n" +
@@ -475,6 +486,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     fPrintToConsole = GetBoolArg("-printtoconsole");
     fPrintToDebugger = GetBoolArg("-printtodebugger");
     fLogTimestamps = GetBoolArg("-logtimestamps", true);
+    fLockProfile = GetBoolArg("-lockprofile");
 
     if (mapArgs.count("-timeout"))
     {
@@ -527,6 +539,8 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     if (GetBoolArg("-shrinkdebugfile", !fDebug))
         ShrinkDebugFile();
+    if (GetBoolArg("-asynclog", true))
+        StartDebugLogWriter();
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("Peercoin version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     printf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
@@ -995,6 +1009,7 @@ bool AppInit2(boost::thread_group& threadGroup)
         nTimeShift = GetArg("-timetravel", 0);
 #endif
 
+    StartPubNotify();
     StartNode(threadGroup);
 
     if (fServer)
@@ -1023,5 +1038,8 @@ bool AppInit2(boost::thread_group& threadGroup)
     // Run a thread to flush wallet periodically
     threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
 
+    // Run a thread to keep the key pool topped up
+    threadGroup.create_thread(boost::bind(&ThreadKeyPoolTopUp, pwalletMain));
+
     return !fRequestShutdown;
 }
@@ -3,8 +3,24 @@
 #include "wallet.h"
 #include "base58.h"
 
+#include <math.h>
+
 using namespace std;
 
+// Coin-days an output of nValue created at nTime has timeOffset seconds after nNow
+static int64 GetCoinDayWeight(int64 nValue, int64 nTime, int64 nNow, int64 timeOffset)
+{
+    int64 nDayWeight = (min(nNow - nTime + timeOffset, (int64)STAKE_MAX_AGE) - nStakeMinAge) / 86400;
+    return max(nValue * nDayWeight / COIN, (int64)0);
+}
+
+// Chance per second and coin-day to find a kernel: target / 2^256 with
+// target = 2^224 / difficulty
+static double GetProbPerCoinDay(double difficulty)
+{
+    return ldexp(1.0, -32) / difficulty;
+}
+
 bool KernelRecord::showTransaction(const CWalletTx &wtx)
 {
     if (wtx.IsCoinBase())
@@ -27,7 +43,7 @@ vector<KernelRecord> KernelRecord::decomposeOutput(const CWallet *wallet, const
     int64 nTime = wtx.GetTxTime();
     uint256 hash = wtx.GetHash();
     std::map<std::string, std::string> mapValue = wtx.mapValue;
-    int nDayWeight = (min((GetAdjustedTime() - nTime), (int64)STAKE_MAX_AGE) - nStakeMinAge) / 86400;
+    int64 nNow = GetAdjustedTime();
 
     if (showTransaction(wtx))
     {
@@ -38,7 +54,7 @@ vector<KernelRecord> KernelRecord::decomposeOutput(const CWallet *wallet, const
                 CTxDestination address;
                 std::string addrStr;
 
-                uint64 coinAge = max(txOut.nValue * nDayWeight / COIN, (int64)0);
+                int64 coinAge = GetCoinDayWeight(txOut.nValue, nTime, nNow, 0);
 
                 if (ExtractDestination(txOut.scriptPubKey, address))
                 {
@@ -59,6 +75,47 @@ vector<KernelRecord> KernelRecord::decomposeOutput(const CWallet *wallet, const
     return parts;
 }
 
+/*
+ * Kernel records of all unspent outputs of the wallet, from its coin index
+ * (requires cs_wallet). Like mapWallet, the records are sorted by hash.
+ */
+void KernelRecord::decomposeCoins(const CWallet *wallet, vector<KernelRecord> &records)
+{
+    records.clear();
+    records.reserve(wallet->mapCoins.size());
+    int64 nNow = GetAdjustedTime();
+
+    const CWalletTx *pcoinLast = NULL;
+    bool fShow = false;
+    for (map<COutPoint, CWalletCoin>::const_iterator it = wallet->mapCoins.begin(); it != wallet->mapCoins.end(); ++it)
+    {
+        const CWalletTx *pcoin = it->second.ptx;
+        if (pcoin != pcoinLast)
+        {
+            fShow = showTransaction(*pcoin);
+            pcoinLast = pcoin;
+        }
+        if (!fShow)
+            continue;
+
+        const CTxOut &txOut = pcoin->vout[it->second.n];
+        int64 nTime = pcoin->GetTxTime();
+        CTxDestination address;
+        std::string addrStr;
+        if (ExtractDestination(txOut.scriptPubKey, address))
+            addrStr = CBitcoinAddress(address).ToString();
+        else
+        {
+            mapValue_t::const_iterator mi = pcoin->mapValue.find("to");
+            if (mi != pcoin->mapValue.end())
+                addrStr = mi->second;
+        }
+
+        records.push_back(KernelRecord(it->first.hash, nTime, addrStr, txOut.nValue, it->second.n, false,
+                                       GetCoinDayWeight(txOut.nValue, nTime, nNow, 0)));
+    }
+}
+
 std::string KernelRecord::getTxID()
 {
     return hash.ToString() + strprintf("-%03d", idx);
@@ -71,40 +128,53 @@ int64 KernelRecord::getAge() const
 
 double KernelRecord::getProbToMintStake(double difficulty, int timeOffset) const
 {
-    double maxTarget = pow(static_cast<double>(2), 224);
-    double target = maxTarget / difficulty;
-    int dayWeight = (min((GetAdjustedTime() - nTime) + timeOffset, (int64)STAKE_MAX_AGE) - nStakeMinAge) / 86400;
-    uint64 coinAge = max(nValue * dayWeight / COIN, (int64)0);
-    return target * coinAge / pow(static_cast<double>(2), 256);
+    return GetProbPerCoinDay(difficulty) * GetCoinDayWeight(nValue, nTime, GetAdjustedTime(), timeOffset);
 }
 
+/*
+ * The chance per second p is tiny, so the chance not to mint in n seconds,
+ * (1 - p)^n, is exp(-n * p) and the chances of the days of the interval
+ * multiply to a single exponential of the coin-day seconds. The coin-days
+ * only change from day to day until the output reaches full weight.
+ */
 double KernelRecord::getProbToMintWithinNMinutes(double difficulty, int minutes)
 {
     if(difficulty != prevDifficulty || minutes != prevMinutes)
     {
-        double prob = 1;
-        double p;
+        int64 nNow = GetAdjustedTime();
         int d = minutes / (60 * 24); // Number of full days
         int m = minutes % (60 * 24); // Number of minutes in the last day
-        int i, timeOffset;
+        double weight = 0;
+        int i;
 
-        // Probabilities for the first d days
-        for(i = 0; i < d; i++)
-        {
-            timeOffset = i * 86400;
-            p = pow(1 - getProbToMintStake(difficulty, timeOffset), 86400);
-            prob *= p;
-        }
+        // Coin-day seconds of the first d days
+        for(i = 0; i < d && nNow - nTime + (int64)i * 86400 < STAKE_MAX_AGE; i++)
+            weight += 86400.0 * GetCoinDayWeight(nValue, nTime, nNow, (int64)i * 86400);
+        if(i < d)
+            weight += 86400.0 * (d - i) * GetCoinDayWeight(nValue, nTime, nNow, (int64)i * 86400);
 
-        // Probability for the m minutes of the last day
-        timeOffset = d * 86400;
-        p = pow(1 - getProbToMintStake(difficulty, timeOffset), 60 * m);
-        prob *= p;
+        // Coin-day seconds of the m minutes of the last day
+        weight += 60.0 * m * GetCoinDayWeight(nValue, nTime, nNow, (int64)d * 86400);
 
-        prob = 1 - prob;
-        prevProbability = prob;
+        prevProbability = -expm1(-weight * GetProbPerCoinDay(difficulty));
         prevDifficulty = difficulty;
         prevMinutes = minutes;
     }
     return prevProbability;
 }
+
+double KernelRecord::getLastProofOfStakeDifficulty()
+{
+    static uint256 hashLastBest;
+    static double dLastDifficulty = 0;
+    static CCriticalSection cs_difficulty;
+
+    LOCK(cs_difficulty);
+    const CBlockIndex *pindex = pindexBest;
+    if (pindex && pindex->GetBlockHash() != hashLastBest)
+    {
+        dLastDifficulty = GetLastBlockIndex(pindex, true)->GetBlockDifficulty();
+        hashLastBest = pindex->GetBlockHash();
+    }
+    return dLastDifficulty;
+}
@@ -29,6 +29,7 @@ public:
 
     static bool showTransaction(const CWalletTx &wtx);
     static std::vector<KernelRecord> decomposeOutput(const CWallet *wallet, const CWalletTx &wtx);
+    static void decomposeCoins(const CWallet *wallet, std::vector<KernelRecord> &records);
 
 
     uint256 hash;
@@ -43,6 +44,7 @@ public:
     int64 getAge() const;
     double getProbToMintStake(double difficulty, int timeOffset = 0) const;
     double getProbToMintWithinNMinutes(double difficulty, int minutes);
+    static double getLastProofOfStakeDifficulty();
 protected:
     int prevMinutes;
     double prevDifficulty;
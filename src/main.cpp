@@ -16,6 +16,7 @@
 #include "kernel.h"
 #include "checkqueue.h"
 #include "checkpointsync.h"
+#include "notifier.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -135,6 +136,23 @@ void static EraseFromWallets(uint256 hash)
         pwallet->EraseFromWallet(hash);
 }
 
+// groups the database writes of all wallets into one transaction per wallet
+// for as long as it is in scope, e.g. while syncing the transactions of a block
+class CWalletsBatch
+{
+public:
+    CWalletsBatch()
+    {
+        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+            pwallet->BeginBatch();
+    }
+    ~CWalletsBatch()
+    {
+        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+            pwallet->CommitBatch();
+    }
+};
+
 // make sure all wallets know about the given transaction, in the given block
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate, bool fConnect)
 {
@@ -147,6 +165,8 @@ void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock*
                 if (pwallet->IsFromMe(tx))
                     pwallet->DisableTransaction(tx);
         }
+        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+            pwallet->DisconnectedTransaction(hash);
         return;
     }
 
@@ -650,9 +670,10 @@ bool CTransaction::CheckTransaction(CValidationState &state) const
 }
 
 int64 CTransaction::GetMinFee(unsigned int nBlockSize, bool fAllowFree,
-                              enum GetMinFee_mode mode) const
+                              enum GetMinFee_mode mode, unsigned int nBytes) const
 {
-    unsigned int nBytes = ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
+    if (nBytes == 0)
+        nBytes = ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
     unsigned int nNewBlockSize = nBlockSize + nBytes;
     int64 nMinFee;
 
@@ -809,7 +830,7 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
         // Don't accept it if it can't get into a block
-        int64 txMinFee = tx.GetMinFee(1000, false, GMF_RELAY);
+        int64 txMinFee = tx.GetMinFee(1000, false, GMF_RELAY, nSize);
         if (nFees < txMinFee)
             return error("CTxMemPool::accept() : not enough fees %s, %" PRI64d" < %" PRI64d,
                          hash.ToString().c_str(),
@@ -856,6 +877,7 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         }
         addUnchecked(hash, tx);
     }
+    PubNotifyTransaction(tx);
 
     ///// are we sure this is ok when loading transactions or restoring block txes
     // If updated, erase old tx from wallet
@@ -954,11 +976,17 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
     if (hashBlock == 0 || nIndex == -1)
         return 0;
 
-    // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
-    if (mi == mapBlockIndex.end())
-        return 0;
-    CBlockIndex* pindex = (*mi).second;
+    // Find the block it claims to be in. The cached entry stays valid (see
+    // mapBlockIndex) until hashBlock changes; whether it is still in the
+    // main chain is checked below.
+    CBlockIndex* pindex = pindexCached;
+    if (!pindex || pindex->GetBlockHash() != hashBlock)
+    {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi == mapBlockIndex.end())
+            return 0;
+        pindex = pindexCached = (*mi).second;
+    }
     if (!pindex || !pindex->IsInMainChain())
         return 0;
 
@@ -971,7 +999,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
     }
 
     pindexRet = pindex;
-    return pindexBest->nHeight - pindex->nHeight + 1;
+    return nBestHeight - pindex->nHeight + 1;
 }
 
 
@@ -1519,7 +1547,8 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
             if (!GetCoinAge(state, inputs, nCoinAge))
                 return error("CheckInputs() : %s unable to get coin age for coinstake", GetHash().ToString().c_str());
             int64 nStakeReward = GetValueOut() - nValueIn;
-            int64 nCoinstakeCost = (GetMinFee() < PERKB_TX_FEE)? 0 : (GetMinFee() - PERKB_TX_FEE);
+            int64 nMinFee = GetMinFee();
+            int64 nCoinstakeCost = (nMinFee < PERKB_TX_FEE)? 0 : (nMinFee - PERKB_TX_FEE);
             if (nStakeReward > GetProofOfStakeReward(nCoinAge) - nCoinstakeCost)
                 return state.DoS(100, error("CheckInputs() : %s stake reward exceeded", GetHash().ToString().c_str()));
         }
@@ -1533,8 +1562,9 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
             if (nTxFee < 0)
                 return state.DoS(100, error("CheckInputs() : %s nTxFee < 0", GetHash().ToString().c_str()));
             // ppcoin: enforce transaction fees for every block
-            if (nTxFee < GetMinFee())
-                return state.DoS(100, error("CheckInputs() : %s not paying required fee=%s, paid=%s", GetHash().ToString().c_str(), FormatMoney(GetMinFee()).c_str(), FormatMoney(nTxFee).c_str()));
+            int64 nMinFee = GetMinFee();
+            if (nTxFee < nMinFee)
+                return state.DoS(100, error("CheckInputs() : %s not paying required fee=%s, paid=%s", GetHash().ToString().c_str(), FormatMoney(nMinFee).c_str(), FormatMoney(nTxFee).c_str()));
             nFees += nTxFee;
             if (!MoneyRange(nFees))
                 return state.DoS(100, error("CheckInputs() : nFees out of range"));
@@ -1659,8 +1689,11 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
     view.SetBestBlock(pindex->pprev);
 
     // ppcoin: clean up wallet after disconnecting coinstake
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        SyncWithWallets(tx.GetHash(), tx, this, false, false);
+    {
+        CWalletsBatch batch;
+        BOOST_FOREACH(CTransaction& tx, vtx)
+            SyncWithWallets(tx.GetHash(), tx, this, false, false);
+    }
 
     if (pfClean) {
         *pfClean = fClean;
@@ -1870,8 +1903,11 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     assert(view.SetBestBlock(pindex));
 
     // Watch for transactions paying to me
-    for (unsigned int i=0; i<vtx.size(); i++)
-        SyncWithWallets(GetTxHash(i), vtx[i], this, true);
+    {
+        CWalletsBatch batch;
+        for (unsigned int i=0; i<vtx.size(); i++)
+            SyncWithWallets(GetTxHash(i), vtx[i], this, true);
+    }
 
     return true;
 }
@@ -2021,6 +2057,8 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+    BOOST_FOREACH(CBlockIndex* pindex, vConnect)
+        PubNotifyBlock(pindex);
     printf("SetBestChain: new best=%s  height=%d  log2_trust=%.8g  moneysupply=%s  tx=%lu  date=%s progress=%f\n",
       hashBestChain.ToString().c_str(), nBestHeight, log(nBestChainTrust.getdouble())/log(2.0), FormatMoney(pindexBest->nMoneySupply).c_str(),
       (unsigned long)pindexNew->nChainTx,
@@ -2390,7 +2428,10 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     // Check coinbase reward
     int64 nCoinbaseCost = 0;
     if (IsProofOfWork())
-        nCoinbaseCost = (vtx[0].GetMinFee() < PERKB_TX_FEE)? 0 : (vtx[0].GetMinFee() - PERKB_TX_FEE);
+    {
+        int64 nMinFee = vtx[0].GetMinFee();
+        nCoinbaseCost = (nMinFee < PERKB_TX_FEE)? 0 : (nMinFee - PERKB_TX_FEE);
+    }
 
     if (vtx[0].GetValueOut() > (IsProofOfWork()? (GetProofOfWorkReward(nBits) - nCoinbaseCost) : 0))
         return state.DoS(50, error("CheckBlock() : coinbase reward exceeded %s > %s",
@@ -3737,10 +3778,7 @@ void static ProcessGetData(CNode* pfrom)
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
-    if (fDebug) {
-        printf("%s ", DateTimeStrFormat(GetTime()).c_str());
-        printf("received: %s (%" PRIszu" bytes)\n", strCommand.c_str(), vRecv.size());
-    }
+    LogPrint("net", "received: %s (%" PRIszu" bytes)\n", strCommand.c_str(), vRecv.size());
     if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
     {
         printf("dropmessagestest DROPPING RECV MESSAGE\n");
@@ -3984,8 +4022,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             pfrom->AddInventoryKnown(inv);
 
             bool fAlreadyHave = AlreadyHave(inv);
-            if (fDebug)
-                printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
+            LogPrint("net", "  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave) {
                 if (!fImporting && !fReindex)
@@ -3997,8 +4034,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 // the last block in an inv bundle sent in response to getblocks. Try to detect
                 // this situation and push another getblocks to continue.
                 pfrom->PushGetBlocks(mapBlockIndex[inv.hash], uint256(0));
-                if (fDebug)
-                    printf("force request: %s\n", inv.ToString().c_str());
+                LogPrint("net", "force request: %s\n", inv.ToString().c_str());
             }
 
             // Track requests for our stuff
@@ -4764,11 +4800,13 @@ public:
     set<uint256> setDependsOn;
     double dPriority;
     double dFeePerKb;
+    unsigned int nTxSize;
 
     COrphan(CTransaction* ptxIn)
     {
         ptx = ptxIn;
         dPriority = dFeePerKb = 0;
+        nTxSize = 0;
     }
 
     void print() const
@@ -4788,7 +4826,8 @@ int64 nLastCoinStakeSearchInterval = 0;
 #ifndef DISABLE_MINING
 
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+// (the serialized size is kept along, so that it is only computed once)
+typedef boost::tuple<double, double, CTransaction*, unsigned int> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -4976,9 +5015,10 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey, CWallet* pwallet, bool f
             {
                 porphan->dPriority = dPriority;
                 porphan->dFeePerKb = dFeePerKb;
+                porphan->nTxSize = nTxSize;
             }
             else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
+                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second, nTxSize));
         }
 
         // Collect transactions into block
@@ -4996,12 +5036,12 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey, CWallet* pwallet, bool f
             double dPriority = vecPriority.front().get<0>();
             double dFeePerKb = vecPriority.front().get<1>();
             CTransaction& tx = *(vecPriority.front().get<2>());
+            unsigned int nTxSize = vecPriority.front().get<3>();
 
             std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
             vecPriority.pop_back();
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
             if (nBlockSize + nTxSize >= nBlockMaxSize)
                 continue;
 
@@ -5033,7 +5073,7 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey, CWallet* pwallet, bool f
 
             int64 nTxFees = tx.GetValueIn(view)-tx.GetValueOut();
             // ppcoin: simplify transaction fee - allow free = false
-            int64 nMinFee = tx.GetMinFee(nBlockSize, false, GMF_BLOCK);
+            int64 nMinFee = tx.GetMinFee(nBlockSize, false, GMF_BLOCK, nTxSize);
             if (nTxFees < nMinFee)
                 continue;
 
@@ -5074,7 +5114,7 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey, CWallet* pwallet, bool f
                         porphan->setDependsOn.erase(hash);
                         if (porphan->setDependsOn.empty())
                         {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
+                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx, porphan->nTxSize));
                             std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
                         }
                     }
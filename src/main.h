@@ -96,6 +96,9 @@ extern CScript COINBASE_FLAGS;
 
 
 extern CCriticalSection cs_main;
+// Block index entries are never erased or freed, so a CBlockIndex* stays
+// valid after cs_main is released. Its chain links (pnext) and the chain
+// tip may still change, read them under cs_main where that matters.
 extern std::map<uint256, CBlockIndex*> mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern std::set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid;
@@ -348,6 +351,7 @@ public:
     }
 };
 
+SERIALIZE_FIXED_SIZE(COutPoint, sizeof(uint256) + sizeof(unsigned int))
 
 
 
@@ -695,7 +699,8 @@ public:
         return dPriority > COIN * 144 / 250;
     }
 
-    int64 GetMinFee(unsigned int nBlockSize=1, bool fAllowFree=false, enum GetMinFee_mode mode=GMF_BLOCK) const;
+    // nBytes is the serialized size of the transaction, if the caller has it already
+    int64 GetMinFee(unsigned int nBlockSize=1, bool fAllowFree=false, enum GetMinFee_mode mode=GMF_BLOCK, unsigned int nBytes=0) const;
 
     friend bool operator==(const CTransaction& a, const CTransaction& b)
     {
@@ -1245,6 +1250,7 @@ public:
 
     // memory only
     mutable bool fMerkleVerified;
+    mutable CBlockIndex* pindexCached; // index of hashBlock, to skip the mapBlockIndex lookup
 
 
     CMerkleTx()
@@ -1262,6 +1268,7 @@ public:
         hashBlock = 0;
         nIndex = -1;
         fMerkleVerified = false;
+        pindexCached = NULL;
     }
 
 
@@ -1447,6 +1454,8 @@ public:
     void UpdateTime(const CBlockIndex* pindexPrev);
 };
 
+SERIALIZE_FIXED_SIZE(CBlockHeader, 80)
+
 class CBlock : public CBlockHeader
 {
 public:
@@ -0,0 +1,228 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "notifier.h"
+#include "main.h"
+#include "util.h"
+
+#include <boost/asio.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <deque>
+#include <set>
+
+using namespace std;
+using namespace boost::asio;
+
+enum PubTopic
+{
+    PUB_HASHBLOCK,
+    PUB_RAWBLOCK,
+    PUB_HASHTX,
+    PUB_RAWTX,
+    PUB_TOPICS
+};
+
+static const char* const vPubTopicNames[PUB_TOPICS] = { "hashblock", "rawblock", "hashtx", "rawtx" };
+
+// Bytes queued for a subscriber before it is disconnected as too slow
+static const size_t MAX_PUB_QUEUE_SIZE = 64 * 1024 * 1024;
+
+typedef boost::shared_ptr<const vector<char> > PubMessage;
+
+class CPubSubscriber
+{
+public:
+    ip::tcp::socket socket;
+    deque<PubMessage> queue;
+    size_t nQueued;
+
+    CPubSubscriber(io_service& io_service) : socket(io_service), nQueued(0) {}
+};
+
+// Created by StartPubNotify, destroyed in StopPubNotify. mutexPubNotify
+// guards the pointers, the rest is only used by the publisher thread.
+static boost::mutex mutexPubNotify;
+static io_service* pub_io_service = NULL;
+static ip::tcp::acceptor* pub_acceptor = NULL;
+static boost::thread* pub_thread = NULL;
+
+static set<boost::shared_ptr<CPubSubscriber> > setPubSubscribers;
+static unsigned int vPubSequence[PUB_TOPICS];
+
+static void PubSend(boost::shared_ptr<CPubSubscriber> sub);
+
+static void PubWriteHandler(boost::shared_ptr<CPubSubscriber> sub, const boost::system::error_code& error)
+{
+    if (error)
+    {
+        setPubSubscribers.erase(sub);
+        return;
+    }
+
+    sub->nQueued -= sub->queue.front()->size();
+    sub->queue.pop_front();
+    if (!sub->queue.empty())
+        PubSend(sub);
+}
+
+static void PubSend(boost::shared_ptr<CPubSubscriber> sub)
+{
+    async_write(sub->socket, buffer(*sub->queue.front()),
+                boost::bind(&PubWriteHandler, sub, boost::asio::placeholders::error));
+}
+
+static void PubPublish(PubTopic topic, const vector<unsigned char>& vchPayload)
+{
+    unsigned int nSequence = vPubSequence[topic]++;
+    if (setPubSubscribers.empty())
+        return;
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << (unsigned int)0 << string(vPubTopicNames[topic]) << nSequence << vchPayload;
+    unsigned int nLength = ss.size() - sizeof(nLength);
+    memcpy(&ss[0], &nLength, sizeof(nLength));
+    PubMessage msg(new vector<char>(ss.begin(), ss.end()));
+
+    vector<boost::shared_ptr<CPubSubscriber> > vSlow;
+    BOOST_FOREACH(const boost::shared_ptr<CPubSubscriber>& sub, setPubSubscribers)
+    {
+        if (sub->nQueued + msg->size() > MAX_PUB_QUEUE_SIZE)
+        {
+            vSlow.push_back(sub);
+            continue;
+        }
+        sub->queue.push_back(msg);
+        sub->nQueued += msg->size();
+        if (sub->queue.size() == 1)
+            PubSend(sub);
+    }
+    BOOST_FOREACH(const boost::shared_ptr<CPubSubscriber>& sub, vSlow)
+    {
+        printf("PubNotify: disconnecting a subscriber that is %" PRIszu" bytes behind\n", sub->nQueued);
+        boost::system::error_code ec;
+        sub->socket.close(ec);
+        setPubSubscribers.erase(sub);
+    }
+}
+
+static void PubPublishBlock(const CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    PubPublish(PUB_HASHBLOCK, vector<unsigned char>(hash.begin(), hash.end()));
+
+    // The block is only read when somebody receives it
+    if (setPubSubscribers.empty())
+    {
+        vPubSequence[PUB_RAWBLOCK]++;
+        return;
+    }
+    CBlock block;
+    if (!block.ReadFromDisk(pindex))
+    {
+        printf("PubNotify: failed to read block %s\n", hash.ToString().c_str());
+        vPubSequence[PUB_RAWBLOCK]++;
+        return;
+    }
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    PubPublish(PUB_RAWBLOCK, vector<unsigned char>(ss.begin(), ss.end()));
+}
+
+static void PubPublishTransaction(const uint256& hash, const boost::shared_ptr<vector<unsigned char> >& pvchTx)
+{
+    PubPublish(PUB_HASHTX, vector<unsigned char>(hash.begin(), hash.end()));
+    PubPublish(PUB_RAWTX, *pvchTx);
+}
+
+static void PubListen();
+
+static void PubAcceptHandler(boost::shared_ptr<CPubSubscriber> sub, const boost::system::error_code& error)
+{
+    if (error == error::operation_aborted)
+        return;
+    if (!error)
+        setPubSubscribers.insert(sub);
+    PubListen();
+}
+
+static void PubListen()
+{
+    boost::shared_ptr<CPubSubscriber> sub(new CPubSubscriber(*pub_io_service));
+    pub_acceptor->async_accept(sub->socket, boost::bind(&PubAcceptHandler, sub, boost::asio::placeholders::error));
+}
+
+static void ThreadPubNotify(io_service* io_service)
+{
+    RenameThread("peercoin-pubnotify");
+    io_service->run();
+}
+
+void StartPubNotify()
+{
+    int nPort = GetArg("-pubnotify", 0);
+    if (nPort <= 0)
+        return;
+
+    boost::unique_lock<boost::mutex> lock(mutexPubNotify);
+    assert(pub_io_service == NULL);
+    pub_io_service = new io_service();
+    pub_acceptor = new ip::tcp::acceptor(*pub_io_service);
+
+    ip::tcp::endpoint endpoint(ip::address_v4::loopback(), nPort);
+    try
+    {
+        pub_acceptor->open(endpoint.protocol());
+        pub_acceptor->set_option(ip::tcp::acceptor::reuse_address(true));
+        pub_acceptor->bind(endpoint);
+        pub_acceptor->listen(socket_base::max_connections);
+    }
+    catch (boost::system::system_error &e)
+    {
+        printf("PubNotify: unable to listen on port %u: %s\n", endpoint.port(), e.what());
+        delete pub_acceptor; pub_acceptor = NULL;
+        delete pub_io_service; pub_io_service = NULL;
+        return;
+    }
+
+    PubListen();
+    pub_thread = new boost::thread(boost::bind(&ThreadPubNotify, pub_io_service));
+    printf("PubNotify: publishing on 127.0.0.1:%u\n", endpoint.port());
+}
+
+void StopPubNotify()
+{
+    boost::unique_lock<boost::mutex> lock(mutexPubNotify);
+    if (pub_io_service == NULL)
+        return;
+
+    pub_io_service->stop();
+    pub_thread->join();
+    delete pub_thread; pub_thread = NULL;
+    setPubSubscribers.clear();
+    delete pub_acceptor; pub_acceptor = NULL;
+    delete pub_io_service; pub_io_service = NULL;
+}
+
+void PubNotifyBlock(const CBlockIndex* pindex)
+{
+    boost::unique_lock<boost::mutex> lock(mutexPubNotify);
+    if (pub_io_service)
+        pub_io_service->post(boost::bind(&PubPublishBlock, pindex));
+}
+
+void PubNotifyTransaction(const CTransaction& tx)
+{
+    boost::unique_lock<boost::mutex> lock(mutexPubNotify);
+    if (!pub_io_service)
+        return;
+
+    // Serialized here, tx may change once the caller returns
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    boost::shared_ptr<vector<unsigned char> > pvchTx(new vector<unsigned char>(ss.begin(), ss.end()));
+    pub_io_service->post(boost::bind(&PubPublishTransaction, tx.GetHash(), pvchTx));
+}
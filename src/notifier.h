@@ -0,0 +1,37 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_NOTIFIER_H
+#define BITCOIN_NOTIFIER_H
+
+class CBlockIndex;
+class CTransaction;
+
+/**
+ * Publisher of chain events to local subscribers, enabled with
+ * -pubnotify=<port>. Subscribers connect to 127.0.0.1:<port> and receive
+ * messages, without sending anything. Each message is
+ *
+ *   uint32 nLength   size of the rest of the message
+ *   string topic     "hashblock", "rawblock", "hashtx" or "rawtx"
+ *   uint32 nSequence number of the message in its topic, from 0 at startup
+ *   bytes  payload   the hash, or the serialized block or transaction
+ *
+ * with the usual network serialization: integers are little endian, and
+ * the topic and payload are preceded by their size as a compact size.
+ * Hashes are in their serialized byte order. Subscribers find missed
+ * messages from gaps in the sequence numbers.
+ *
+ * Blocks are published when they are connected to the main chain, and
+ * transactions when they are accepted to the memory pool. A subscriber
+ * that falls more than 64 MB behind is disconnected.
+ */
+
+void StartPubNotify();
+void StopPubNotify();
+
+// pindex is read after the call returns, see mapBlockIndex
+void PubNotifyBlock(const CBlockIndex* pindex);
+void PubNotifyTransaction(const CTransaction& tx);
+
+#endif
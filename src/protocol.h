@@ -142,6 +142,8 @@ class CInv
         uint256 hash;
 };
 
+SERIALIZE_FIXED_SIZE(CInv, sizeof(int) + sizeof(uint256))
+
 enum
 {
     MSG_TX = 1,
@@ -72,19 +72,14 @@ public:
     {
         OutputDebugStringF("refreshWallet\n");
         cachedWallet.clear();
+        std::vector<KernelRecord> records;
         {
             LOCK(wallet->cs_wallet);
-            for(std::map<uint256, CWalletTx>::iterator it = wallet->mapWallet.begin(); it != wallet->mapWallet.end(); ++it)
-            {
-                std::vector<KernelRecord> txList = KernelRecord::decomposeOutput(wallet, it->second);
-                if(KernelRecord::showTransaction(it->second))
-                    foreach(const KernelRecord& kr, txList) {
-                        if(!kr.spent) {
-                            cachedWallet.append(kr);
-                        }
-                    }
-            }
+            KernelRecord::decomposeCoins(wallet, records);
         }
+        cachedWallet.reserve(records.size());
+        foreach(const KernelRecord& kr, records)
+            cachedWallet.append(kr);
     }
 
     /* Update our model of the wallet incrementally, to synchronize our model of the wallet
@@ -401,8 +396,7 @@ QString MintingTableModel::lookupAddress(const std::string &address, bool toolti
 
 double MintingTableModel::getDayToMint(KernelRecord *wtx) const
 {
-    const CBlockIndex *p = GetLastBlockIndex(pindexBest, true);
-    double difficulty = p->GetBlockDifficulty();
+    double difficulty = KernelRecord::getLastProofOfStakeDifficulty();
 
     double prob = wtx->getProbToMintWithinNMinutes(difficulty, mintingInterval);
     prob = prob * 100;
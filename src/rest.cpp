@@ -0,0 +1,406 @@
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcserver.h"
+#include "main.h"
+
+#include <boost/algorithm/string.hpp>
+
+using namespace json_spirit;
+using namespace std;
+
+void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail, CJSONWriter& writer);
+void blockheaderToJSON(const CBlockIndex* blockindex, CJSONWriter& writer);
+void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry);
+void ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out);
+
+//
+// Read-only REST interface, enabled with -rest. It needs no authentication
+// and serves chain data in binary, hex or JSON:
+//   /rest/block/<hash>.<ext>
+//   /rest/headers/<count>/<hash>.<ext>
+//   /rest/tx/<txid>.<ext>
+//   /rest/getutxos[/checkmempool]/<txid>-<n>/<txid>-<n>/....<ext>
+//
+
+enum RESTFormat
+{
+    RF_BINARY,
+    RF_HEX,
+    RF_JSON,
+};
+
+// Headers returned by one /rest/headers request at most
+static const unsigned int MAX_REST_HEADERS = 2000;
+// Outpoints looked up by one /rest/getutxos request at most
+static const unsigned int MAX_REST_OUTPOINTS = 100;
+
+// Bytes read from a block file at a time when a block is sent
+static const size_t REST_BLOCK_CHUNK_SIZE = 65536;
+
+class RESTError
+{
+public:
+    int nStatus;
+    string strMessage;
+
+    RESTError(int nStatusIn, const string& strMessageIn) : nStatus(nStatusIn), strMessage(strMessageIn) {}
+};
+
+/** An unspent output as returned by /rest/getutxos */
+class CRESTCoin
+{
+public:
+    int nTxVer;
+    int nHeight;
+    CTxOut out;
+
+    CRESTCoin() : nTxVer(0), nHeight(0) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nTxVer);
+        READWRITE(nHeight);
+        READWRITE(out);
+    )
+};
+
+// Strip the format extension from the last part of the path
+static RESTFormat ParseDataFormat(string& strParam)
+{
+    size_t nPos = strParam.rfind('.');
+    if (nPos == string::npos)
+        throw RESTError(HTTP_NOT_FOUND, "output format not found (available: bin, hex, json)");
+
+    string strFormat = strParam.substr(nPos + 1);
+    strParam.resize(nPos);
+    if (strFormat == "bin")
+        return RF_BINARY;
+    if (strFormat == "hex")
+        return RF_HEX;
+    if (strFormat == "json")
+        return RF_JSON;
+    throw RESTError(HTTP_NOT_FOUND, "output format not found (available: bin, hex, json)");
+}
+
+static uint256 ParseHash(const string& strHash)
+{
+    if (strHash.size() != 64 || !IsHex(strHash))
+        throw RESTError(HTTP_BAD_REQUEST, "Invalid hash: " + strHash);
+    return uint256(strHash);
+}
+
+// Send data serialized by ss in the requested binary or hex format
+static bool SendSerialized(std::iostream& stream, const CDataStream& ss, RESTFormat rf, bool fKeepAlive)
+{
+    if (rf == RF_BINARY)
+    {
+        stream << HTTPReplyHeader(HTTP_OK, fKeepAlive, ss.size(), "application/octet-stream");
+        // e.g. /rest/headers of a block that is not in the main chain
+        if (!ss.empty())
+            stream.write(&ss[0], ss.size());
+    }
+    else
+        stream << HTTPReply(HTTP_OK, HexStr(ss.begin(), ss.end()) + "\n", fKeepAlive, "text/plain");
+    stream << std::flush;
+    return fKeepAlive && stream.good();
+}
+
+// Send JSON written by func, in chunks as it is produced if the client speaks HTTP/1.1
+static bool SendJSON(std::iostream& stream, int nProto, bool fKeepAlive, boost::function<void(CJSONWriter&)> func)
+{
+    if (nProto >= 1)
+    {
+        CHTTPChunkedStreamBuf buf(stream, HTTPReplyChunkedHeader(HTTP_OK, fKeepAlive));
+        std::ostream os(&buf);
+        CJSONStreamWriter writer(os);
+        func(writer);
+        os << "\n";
+        return buf.Finish() && fKeepAlive;
+    }
+
+    ostringstream ss;
+    CJSONStreamWriter writer(ss);
+    func(writer);
+    ss << "\n";
+    stream << HTTPReply(HTTP_OK, ss.str(), fKeepAlive) << std::flush;
+    return fKeepAlive && stream.good();
+}
+
+/**
+ * Send a block as it is stored in its block file, without deserializing
+ * it. Blocks are stored in network format, preceded by the network magic
+ * and their size (see CBlock::WriteToDisk).
+ */
+static bool SendRawBlock(std::iostream& stream, const CDiskBlockPos& pos, RESTFormat rf, bool fKeepAlive)
+{
+    unsigned int nSize = 0;
+    CAutoFile filein = CAutoFile(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - sizeof(nSize)), true), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        throw RESTError(HTTP_NOT_FOUND, "Block not available");
+    try {
+        filein >> nSize;
+    }
+    catch (std::exception &e) {
+        throw RESTError(HTTP_NOT_FOUND, "Block not available");
+    }
+    if (nSize > MAX_BLOCK_SIZE)
+        throw RESTError(HTTP_INTERNAL_SERVER_ERROR, "Block size in block file is invalid");
+
+    if (rf == RF_BINARY)
+        stream << HTTPReplyHeader(HTTP_OK, fKeepAlive, nSize, "application/octet-stream");
+    else
+        stream << HTTPReplyHeader(HTTP_OK, fKeepAlive, 2 * nSize + 1, "text/plain");
+
+    // The header is sent, from here on an error can only close the connection
+    std::vector<char> vBuf(std::min((size_t)nSize, REST_BLOCK_CHUNK_SIZE));
+    unsigned int nLeft = nSize;
+    while (nLeft > 0)
+    {
+        size_t nRead = std::min((size_t)nLeft, vBuf.size());
+        if (fread(&vBuf[0], 1, nRead, filein) != nRead)
+        {
+            printf("REST: read error in block file %d\n", pos.nFile);
+            return false;
+        }
+        if (rf == RF_BINARY)
+            stream.write(&vBuf[0], nRead);
+        else
+            stream << HexStr(vBuf.begin(), vBuf.begin() + nRead);
+        if (!stream)
+            return false;
+        nLeft -= nRead;
+    }
+    if (rf == RF_HEX)
+        stream << "\n";
+    stream << std::flush;
+    return fKeepAlive && stream.good();
+}
+
+static bool RESTBlock(std::iostream& stream, const vector<string>& vParams, RESTFormat rf, int nProto, bool fKeepAlive)
+{
+    if (vParams.size() != 1)
+        throw RESTError(HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/block/<hash>.<ext>");
+    uint256 hash = ParseHash(vParams[0]);
+
+    CBlockIndex* pblockindex;
+    CDiskBlockPos pos;
+    {
+        LOCK(cs_main);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw RESTError(HTTP_NOT_FOUND, hash.GetHex() + " not found");
+        pblockindex = mi->second;
+        pos = pblockindex->GetBlockPos();
+        if (pos.IsNull())
+            throw RESTError(HTTP_NOT_FOUND, hash.GetHex() + " not available");
+    }
+
+    if (rf != RF_JSON)
+        return SendRawBlock(stream, pos, rf, fKeepAlive);
+
+    CBlock block;
+    if (!block.ReadFromDisk(pblockindex))
+        throw RESTError(HTTP_NOT_FOUND, hash.GetHex() + " not available");
+    return SendJSON(stream, nProto, fKeepAlive, boost::bind(&blockToJSON, boost::cref(block), pblockindex, false, _1));
+}
+
+static void WriteHeadersJSON(const vector<CBlockIndex*>& vHeaders, CJSONWriter& writer)
+{
+    writer.BeginArray();
+    BOOST_FOREACH(const CBlockIndex* pindex, vHeaders)
+        blockheaderToJSON(pindex, writer);
+    writer.EndArray();
+}
+
+static bool RESTHeaders(std::iostream& stream, const vector<string>& vParams, RESTFormat rf, int nProto, bool fKeepAlive)
+{
+    if (vParams.size() != 2)
+        throw RESTError(HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/headers/<count>/<hash>.<ext>");
+    int nCount = atoi(vParams[0].c_str());
+    if (nCount < 1 || (unsigned int)nCount > MAX_REST_HEADERS)
+        throw RESTError(HTTP_BAD_REQUEST, strprintf("Header count out of range: %s", vParams[0].c_str()));
+    uint256 hash = ParseHash(vParams[1]);
+
+    // Collected under cs_main, written after it (see mapBlockIndex)
+    vector<CBlockIndex*> vHeaders;
+    {
+        LOCK(cs_main);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi != mapBlockIndex.end() && mi->second->IsInMainChain())
+        {
+            for (CBlockIndex* pindex = mi->second; pindex && vHeaders.size() < (unsigned int)nCount; pindex = pindex->pnext)
+                vHeaders.push_back(pindex);
+        }
+    }
+
+    if (rf == RF_JSON)
+        return SendJSON(stream, nProto, fKeepAlive, boost::bind(&WriteHeadersJSON, boost::cref(vHeaders), _1));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(vHeaders.size() * 80);
+    BOOST_FOREACH(const CBlockIndex* pindex, vHeaders)
+        ss << pindex->GetBlockHeader();
+    return SendSerialized(stream, ss, rf, fKeepAlive);
+}
+
+static void WriteTxJSON(const CTransaction& tx, const uint256& hashBlock, CJSONWriter& writer)
+{
+    Object entry;
+    {
+        LOCK(cs_main);
+        TxToJSON(tx, hashBlock, entry);
+    }
+    writer.WriteValue(entry);
+}
+
+static bool RESTTx(std::iostream& stream, const vector<string>& vParams, RESTFormat rf, int nProto, bool fKeepAlive)
+{
+    if (vParams.size() != 1)
+        throw RESTError(HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/tx/<txid>.<ext>");
+    uint256 hash = ParseHash(vParams[0]);
+
+    CTransaction tx;
+    uint256 hashBlock = 0;
+    if (!GetTransaction(hash, tx, hashBlock, true))
+        throw RESTError(HTTP_NOT_FOUND, hash.GetHex() + " not found");
+
+    if (rf == RF_JSON)
+        return SendJSON(stream, nProto, fKeepAlive, boost::bind(&WriteTxJSON, boost::cref(tx), boost::cref(hashBlock), _1));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    return SendSerialized(stream, ss, rf, fKeepAlive);
+}
+
+static void WriteUTXOsJSON(int nHeight, const uint256& hashTip, const string& strBitmap, const vector<CRESTCoin>& vCoins, CJSONWriter& writer)
+{
+    writer.BeginObject();
+    writer.Pair("chainHeight", nHeight);
+    writer.Pair("chaintipHash", hashTip.GetHex());
+    writer.Pair("bitmap", strBitmap);
+    writer.Key("utxos");
+    writer.BeginArray();
+    BOOST_FOREACH(const CRESTCoin& coin, vCoins)
+    {
+        Object o;
+        o.push_back(Pair("txvers", coin.nTxVer));
+        o.push_back(Pair("height", coin.nHeight));
+        o.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
+        Object script;
+        ScriptPubKeyToJSON(coin.out.scriptPubKey, script);
+        o.push_back(Pair("scriptPubKey", script));
+        writer.WriteValue(o);
+    }
+    writer.EndArray();
+    writer.EndObject();
+}
+
+static bool RESTGetUTXOs(std::iostream& stream, vector<string> vParams, RESTFormat rf, int nProto, bool fKeepAlive)
+{
+    bool fCheckMemPool = false;
+    if (!vParams.empty() && vParams[0] == "checkmempool")
+    {
+        fCheckMemPool = true;
+        vParams.erase(vParams.begin());
+    }
+    if (vParams.empty())
+        throw RESTError(HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/getutxos[/checkmempool]/<txid>-<n>/....<ext>");
+    if (vParams.size() > MAX_REST_OUTPOINTS)
+        throw RESTError(HTTP_BAD_REQUEST, strprintf("Too many outpoints, at most %u are allowed", MAX_REST_OUTPOINTS));
+
+    vector<COutPoint> vOutPoints;
+    BOOST_FOREACH(const string& strOutPoint, vParams)
+    {
+        size_t nDash = strOutPoint.find('-');
+        if (nDash == string::npos || nDash + 1 == strOutPoint.size() ||
+            strOutPoint.find_first_not_of("0123456789", nDash + 1) != string::npos)
+            throw RESTError(HTTP_BAD_REQUEST, "Invalid outpoint: " + strOutPoint);
+        vOutPoints.push_back(COutPoint(ParseHash(strOutPoint.substr(0, nDash)), atoi(strOutPoint.substr(nDash + 1).c_str())));
+    }
+
+    vector<unsigned char> vBitmap((vOutPoints.size() + 7) / 8);
+    string strBitmap;
+    vector<CRESTCoin> vCoins;
+    int nHeight;
+    uint256 hashTip;
+    {
+        LOCK2(cs_main, mempool.cs);
+        CCoinsViewMemPool viewMemPool(*pcoinsTip, mempool);
+        CCoinsView& view = fCheckMemPool ? (CCoinsView&)viewMemPool : (CCoinsView&)*pcoinsTip;
+        for (unsigned int i = 0; i < vOutPoints.size(); i++)
+        {
+            const COutPoint& outpoint = vOutPoints[i];
+            CCoins coins;
+            bool fHit = false;
+            if (view.GetCoins(outpoint.hash, coins))
+            {
+                if (fCheckMemPool)
+                    mempool.pruneSpent(outpoint.hash, coins);
+                if (outpoint.n < coins.vout.size() && !coins.vout[outpoint.n].IsNull())
+                {
+                    CRESTCoin coin;
+                    coin.nTxVer = coins.nVersion;
+                    coin.nHeight = coins.nHeight;
+                    coin.out = coins.vout[outpoint.n];
+                    vCoins.push_back(coin);
+                    fHit = true;
+                }
+            }
+            vBitmap[i / 8] |= ((unsigned char)fHit) << (i % 8);
+            strBitmap += fHit ? "1" : "0";
+        }
+        nHeight = pcoinsTip->GetBestBlock()->nHeight;
+        hashTip = pcoinsTip->GetBestBlock()->GetBlockHash();
+    }
+
+    if (rf == RF_JSON)
+        return SendJSON(stream, nProto, fKeepAlive, boost::bind(&WriteUTXOsJSON, nHeight, boost::cref(hashTip), boost::cref(strBitmap), boost::cref(vCoins), _1));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << nHeight << hashTip << vBitmap << vCoins;
+    return SendSerialized(stream, ss, rf, fKeepAlive);
+}
+
+bool HTTPReq_REST(std::iostream& stream, const string& strMethod, const string& strURI, int nProto, bool fKeepAlive)
+{
+    try
+    {
+        if (strMethod != "GET")
+            throw RESTError(HTTP_BAD_REQUEST, "Only GET is supported");
+
+        // Everything after /rest/<resource>/, with the format extension on the last part
+        vector<string> vParams;
+        string strPath = strURI.substr(strlen("/rest/"));
+        boost::split(vParams, strPath, boost::is_any_of("/"));
+        string strResource = vParams[0];
+        vParams.erase(vParams.begin());
+        if (vParams.empty())
+            throw RESTError(HTTP_NOT_FOUND, "");
+        RESTFormat rf = ParseDataFormat(vParams.back());
+
+        if (strResource == "block")
+            return RESTBlock(stream, vParams, rf, nProto, fKeepAlive);
+        if (strResource == "headers")
+            return RESTHeaders(stream, vParams, rf, nProto, fKeepAlive);
+        if (strResource == "tx")
+            return RESTTx(stream, vParams, rf, nProto, fKeepAlive);
+        if (strResource == "getutxos")
+            return RESTGetUTXOs(stream, vParams, rf, nProto, fKeepAlive);
+        throw RESTError(HTTP_NOT_FOUND, "");
+    }
+    catch (RESTError& e)
+    {
+        string strMessage = e.strMessage.empty() ? "" : e.strMessage + "\r\n";
+        stream << HTTPReply(e.nStatus, strMessage, fKeepAlive, "text/plain") << std::flush;
+        return fKeepAlive && stream.good();
+    }
+    catch (std::exception& e)
+    {
+        // Part of a reply may have been sent, so the connection is closed
+        printf("REST: %s failed: %s\n", strURI.c_str(), e.what());
+        stream << HTTPReply(HTTP_INTERNAL_SERVER_ERROR, "", false, "text/plain") << std::flush;
+        return false;
+    }
+}
@@ -11,6 +11,10 @@ using namespace std;
 
 void ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out);
 
+// Blocks and headers returned by one getblocks and getblockheaders call at most
+static const unsigned int MAX_RPC_BLOCKS = 1000;
+static const unsigned int MAX_RPC_BLOCK_HEADERS = 2000;
+
 double GetDifficulty(const CBlockIndex* blockindex)
 {
     // Floating point number that is a multiple of the minimum difficulty,
@@ -27,54 +31,148 @@ double GetDifficulty(const CBlockIndex* blockindex)
 }
 
 
-Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail)
+void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail, CJSONWriter& writer)
 {
-    Object result;
-    result.push_back(Pair("hash", block.GetHash().GetHex()));
-    CMerkleTx txGen(block.vtx[0]);
-    txGen.SetMerkleBranch(&block);
-    result.push_back(Pair("confirmations", (int)txGen.GetDepthInMainChain()));
-    result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
-    result.push_back(Pair("height", blockindex->nHeight));
-    result.push_back(Pair("version", block.nVersion));
-    result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    result.push_back(Pair("time", (boost::uint64_t)block.GetBlockTime()));
-    result.push_back(Pair("nonce", (boost::uint64_t)block.nNonce));
-    result.push_back(Pair("bits", HexBits(block.nBits)));
-    result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
-    result.push_back(Pair("mint", ValueFromAmount(blockindex->nMint)));
-
-    if (blockindex->pprev)
-        result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    if (blockindex->pnext)
-        result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
-
-    result.push_back(Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": "")));
-    result.push_back(Pair("proofhash", blockindex->IsProofOfStake()? blockindex->hashProofOfStake.GetHex() : blockindex->GetBlockHash().GetHex()));
-    result.push_back(Pair("entropybit", (int)blockindex->GetStakeEntropyBit()));
-    result.push_back(Pair("modifier", strprintf("%016" PRI64x, blockindex->nStakeModifier)));
-    result.push_back(Pair("modifierchecksum", strprintf("%08x", blockindex->nStakeModifierChecksum)));
+    // The writer may block on the client's socket, so the fields that depend
+    // on the chain are read under cs_main and written after releasing it
+    int nConfirmations;
+    uint256 hashPrev = 0, hashNext = 0;
+    {
+        LOCK(cs_main);
+        CMerkleTx txGen(block.vtx[0]);
+        txGen.SetMerkleBranch(&block);
+        nConfirmations = txGen.GetDepthInMainChain();
+        if (blockindex->pprev)
+            hashPrev = blockindex->pprev->GetBlockHash();
+        if (blockindex->pnext)
+            hashNext = blockindex->pnext->GetBlockHash();
+    }
 
-    Array txinfo;
+    writer.BeginObject();
+    writer.Pair("hash", block.GetHash().GetHex());
+    writer.Pair("confirmations", nConfirmations);
+    writer.Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    writer.Pair("height", blockindex->nHeight);
+    writer.Pair("version", block.nVersion);
+    writer.Pair("merkleroot", block.hashMerkleRoot.GetHex());
+    writer.Pair("time", (boost::uint64_t)block.GetBlockTime());
+    writer.Pair("nonce", (boost::uint64_t)block.nNonce);
+    writer.Pair("bits", HexBits(block.nBits));
+    writer.Pair("difficulty", GetDifficulty(blockindex));
+    writer.Pair("mint", ValueFromAmount(blockindex->nMint));
+
+    if (hashPrev != 0)
+        writer.Pair("previousblockhash", hashPrev.GetHex());
+    if (hashNext != 0)
+        writer.Pair("nextblockhash", hashNext.GetHex());
+
+    writer.Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": ""));
+    writer.Pair("proofhash", blockindex->IsProofOfStake()? blockindex->hashProofOfStake.GetHex() : blockindex->GetBlockHash().GetHex());
+    writer.Pair("entropybit", (int)blockindex->GetStakeEntropyBit());
+    writer.Pair("modifier", strprintf("%016" PRI64x, blockindex->nStakeModifier));
+    writer.Pair("modifierchecksum", strprintf("%08x", blockindex->nStakeModifierChecksum));
+
+    writer.Key("tx");
+    writer.BeginArray();
     BOOST_FOREACH (const CTransaction& tx, block.vtx)
     {
         if (fPrintTransactionDetail)
         {
-            txinfo.push_back(tx.ToStringShort());
-            txinfo.push_back(DateTimeStrFormat(tx.nTime));
+            writer.WriteValue(tx.ToStringShort());
+            writer.WriteValue(DateTimeStrFormat(tx.nTime));
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                txinfo.push_back(txin.ToStringShort());
+                writer.WriteValue(txin.ToStringShort());
             BOOST_FOREACH(const CTxOut& txout, tx.vout)
-                txinfo.push_back(txout.ToStringShort());
+                writer.WriteValue(txout.ToStringShort());
         }
         else
-            txinfo.push_back(tx.GetHash().GetHex());
+            writer.WriteValue(tx.GetHash().GetHex());
     }
-    result.push_back(Pair("tx", txinfo));
+    writer.EndArray();
+    writer.EndObject();
+}
 
-    return result;
+void blockheaderToJSON(const CBlockIndex* blockindex, CJSONWriter& writer)
+{
+    writer.BeginObject();
+    writer.Pair("hash", blockindex->GetBlockHash().GetHex());
+    writer.Pair("height", blockindex->nHeight);
+    writer.Pair("version", blockindex->nVersion);
+    writer.Pair("merkleroot", blockindex->hashMerkleRoot.GetHex());
+    writer.Pair("time", (boost::int64_t)blockindex->nTime);
+    writer.Pair("nonce", (boost::uint64_t)blockindex->nNonce);
+    writer.Pair("bits", HexBits(blockindex->nBits));
+    writer.Pair("difficulty", GetDifficulty(blockindex));
+    if (blockindex->pprev)
+        writer.Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex());
+    writer.EndObject();
 }
 
+/**
+ * Reads the blocks of a range of the chain. The block file stays open from
+ * one block to the next, so blocks stored one after the other are read
+ * sequentially instead of opening the file and seeking for each of them.
+ */
+class CBlockRangeReader
+{
+private:
+    CAutoFile file;
+    int nFile;
+
+public:
+    CBlockRangeReader() : file(NULL, SER_DISK, CLIENT_VERSION), nFile(-1) {}
+
+    bool Read(const CBlockIndex* pindex, CBlock& block)
+    {
+        CDiskBlockPos pos = pindex->GetBlockPos();
+        if (pos.IsNull())
+            return false;
+
+        if (!file || pos.nFile != nFile)
+        {
+            file.fclose();
+            file = OpenBlockFile(pos, true);
+            nFile = pos.nFile;
+            if (!file)
+                return false;
+        }
+        else
+        {
+            // The next block in the file follows the network magic and size
+            // of the block (see CBlock::WriteToDisk), which are skipped
+            // without a seek so that the read buffer is kept
+            long nFilePos = ftell(file);
+            char pchSkip[8];
+            if (nFilePos + (long)sizeof(pchSkip) == (long)pos.nPos)
+            {
+                if (fread(pchSkip, 1, sizeof(pchSkip), file) != sizeof(pchSkip))
+                    return false;
+            }
+            else if (nFilePos != (long)pos.nPos && fseek(file, pos.nPos, SEEK_SET))
+                return false;
+        }
+
+        block.SetNull();
+        try {
+            file >> block;
+        }
+        catch (std::exception &e) {
+            file.fclose();
+            return error("CBlockRangeReader::Read() : deserialize or I/O error");
+        }
+        return block.GetHash() == pindex->GetBlockHash();
+    }
+};
+
+// Blocks of the main chain from nHeight on, at most nCount of them
+static void GetChainRange(int nHeight, int nCount, vector<CBlockIndex*>& vRange)
+{
+    LOCK(cs_main);
+    if (nHeight < 0 || nHeight > nBestHeight)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
+    for (CBlockIndex* pindex = FindBlockByHeight(nHeight); pindex && (int)vRange.size() < nCount; pindex = pindex->pnext)
+        vRange.push_back(pindex);
+}
 
 Value getblockcount(const Array& params, bool fHelp)
 {
@@ -110,12 +208,16 @@ Value settxfee(const Array& params, bool fHelp)
             "<amount> is a real and is rounded to 0.01 (cent)\n"
             "Minimum and default transaction fee per KB is 1 cent");
 
-    nTransactionFee = AmountFromValue(params[0]);
-    nTransactionFee = (nTransactionFee / CENT) * CENT;  // round to cent
+    int64 nFee = AmountFromValue(params[0]);
+    nFee = (nFee / CENT) * CENT;  // round to cent
+
+    // Assign once; wallet sends read the fee under cs_wallet, which
+    // this command holds (RPC_LOCK_WALLET)
+    nTransactionFee = nFee;
     return true;
 }
 
-Value getrawmempool(const Array& params, bool fHelp)
+void getrawmempool(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() != 0)
         throw runtime_error(
@@ -125,11 +227,10 @@ Value getrawmempool(const Array& params, bool fHelp)
     vector<uint256> vtxid;
     mempool.queryHashes(vtxid);
 
-    Array a;
+    writer.BeginArray();
     BOOST_FOREACH(const uint256& hash, vtxid)
-        a.push_back(hash.ToString());
-
-    return a;
+        writer.WriteValue(hash.ToString());
+    writer.EndArray();
 }
 
 Value getblockhash(const Array& params, bool fHelp)
@@ -154,7 +255,8 @@ Value getbestblockhash(const Array& params, bool fHelp)
             "getbestblockhash\n"
             "\nReturns the hash of the best (tip) block in the longest block chain.");
 
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
+    // No cs_main needed to read the tip, see mapBlockIndex
+    CBlockIndex* pblockindex = pindexBest;
     return pblockindex->phashBlock->GetHex();
 }
 
@@ -168,7 +270,7 @@ Value estimatefee(const Array& params, bool fHelp)
     return 0.01;
 }
 
-Value getblock(const Array& params, bool fHelp)
+void getblock(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() < 1 || params.size() > 3)
         throw runtime_error(
@@ -180,13 +282,6 @@ Value getblock(const Array& params, bool fHelp)
     std::string strHash = params[0].get_str();
     uint256 hash(strHash);
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
-
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-    block.ReadFromDisk(pblockindex);
-
     bool fTxinfo = false;
     if (params.size() > 2)
       fTxinfo = params[2].get_bool();
@@ -196,15 +291,91 @@ Value getblock(const Array& params, bool fHelp)
     if (params.size() > 1)
       fVerbose = params[1].get_bool();
 
+    CBlock block;
+    CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+        if (mapBlockIndex.count(hash) == 0)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+
+        pblockindex = mapBlockIndex[hash];
+        block.ReadFromDisk(pblockindex);
+    }
+
     if (!fVerbose)
       {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
         ssBlock << block;
-	std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
+        writer.WriteValue(HexStr(ssBlock.begin(), ssBlock.end()));
+        return;
       }
  
-    return blockToJSON(block, pblockindex, fTxinfo);
+    blockToJSON(block, pblockindex, fTxinfo, writer);
+}
+
+void getblockheaders(const Array& params, bool fHelp, CJSONWriter& writer)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "getblockheaders <height> <count>\n"
+            "Returns the headers of at most <count> blocks of the main chain, starting at <height>.\n"
+            + strprintf("<count> is at most %u.", MAX_RPC_BLOCK_HEADERS));
+
+    int nCount = params[1].get_int();
+    if (nCount < 0 || (unsigned int)nCount > MAX_RPC_BLOCK_HEADERS)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Count out of range");
+
+    // Collected under cs_main, written after it (see mapBlockIndex)
+    vector<CBlockIndex*> vRange;
+    GetChainRange(params[0].get_int(), nCount, vRange);
+
+    writer.BeginArray();
+    BOOST_FOREACH(const CBlockIndex* pindex, vRange)
+        blockheaderToJSON(pindex, writer);
+    writer.EndArray();
+}
+
+void getblocks(const Array& params, bool fHelp, CJSONWriter& writer)
+{
+    if (fHelp || params.size() < 2 || params.size() > 3)
+        throw runtime_error(
+            "getblocks <height> <count> [verbosity=1]\n"
+            "Returns at most <count> blocks of the main chain, starting at <height>.\n"
+            "verbosity 0 returns each block as hex, 1 as an object like getblock,\n"
+            "and 2 as an object with transaction details like getblock with txinfo.\n"
+            + strprintf("<count> is at most %u.", MAX_RPC_BLOCKS));
+
+    int nCount = params[1].get_int();
+    if (nCount < 0 || (unsigned int)nCount > MAX_RPC_BLOCKS)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Count out of range");
+    int nVerbosity = 1;
+    if (params.size() > 2)
+        nVerbosity = params[2].get_int();
+    if (nVerbosity < 0 || nVerbosity > 2)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Verbosity must be 0, 1 or 2");
+
+    vector<CBlockIndex*> vRange;
+    GetChainRange(params[0].get_int(), nCount, vRange);
+
+    // Blocks are read and written one at a time, without holding cs_main
+    CBlockRangeReader reader;
+    writer.BeginArray();
+    BOOST_FOREACH(const CBlockIndex* pindex, vRange)
+    {
+        CBlock block;
+        if (!reader.Read(pindex, block))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Can't read block " + pindex->GetBlockHash().GetHex() + " from disk");
+
+        if (nVerbosity == 0)
+        {
+            CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+            ssBlock << block;
+            writer.WriteValue(HexStr(ssBlock.begin(), ssBlock.end()));
+        }
+        else
+            blockToJSON(block, pindex, nVerbosity > 1, writer);
+    }
+    writer.EndArray();
 }
 
 Value gettxoutsetinfo(const Array& params, bool fHelp)
@@ -72,21 +72,64 @@ Value importprivkey(const Array& params, bool fHelp)
     {
         LOCK2(cs_main, pwalletMain->cs_wallet);
 
-        pwalletMain->MarkDirty();
         pwalletMain->SetAddressBookName(vchAddress, strLabel);
 
         if (!pwalletMain->AddKey(key))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
-	
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
-            pwalletMain->ReacceptWalletTransactions();
-        }
+
+        // Only now does the coin index see outputs to the new key
+        pwalletMain->MarkDirty();
+    }
+
+    // The rescan takes the locks itself, only while adding transactions it found
+    if (fRescan) {
+        pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
+        if (pwalletMain->fAbortRescan)
+            throw JSONRPCError(RPC_MISC_ERROR, "Rescan aborted by user.");
+        pwalletMain->ReacceptWalletTransactions();
     }
 
     return Value::null;
 }
 
+Value getrescaninfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrescaninfo\n"
+            "Returns the progress of the running wallet rescan, if any.");
+
+    Object obj;
+    obj.push_back(Pair("scanning",     (bool)pwalletMain->fScanningWallet));
+    obj.push_back(Pair("birthday",     (boost::int64_t)pwalletMain->nTimeFirstKey));
+    if (pwalletMain->fScanningWallet)
+    {
+        int nStartHeight = pwalletMain->nScanStartHeight;
+        int nHeight = pwalletMain->nScanHeight;
+        int nEndHeight = pwalletMain->nScanEndHeight;
+        obj.push_back(Pair("startheight",  nStartHeight));
+        obj.push_back(Pair("height",       nHeight));
+        obj.push_back(Pair("endheight",    nEndHeight));
+        obj.push_back(Pair("progress",     nEndHeight > nStartHeight ? (double)(nHeight - nStartHeight) / (nEndHeight - nStartHeight) : 1.0));
+        obj.push_back(Pair("duration",     (boost::int64_t)(GetTime() - pwalletMain->nScanStartTime)));
+    }
+    return obj;
+}
+
+Value abortrescan(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "abortrescan\n"
+            "Stops the running wallet rescan, if any.\n"
+            "Returns true if a rescan was running.");
+
+    if (!pwalletMain->fScanningWallet)
+        return false;
+    pwalletMain->fAbortRescan = true;
+    return true;
+}
+
 Value dumpprivkey(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
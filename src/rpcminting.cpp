@@ -4,18 +4,19 @@
 #include "init.h"
 #include "rpcserver.h"
 #include "kernelrecord.h"
+#include "base58.h"
+#include "wallet.h"
 
 using namespace json_spirit;
 using namespace std;
 
-string AccountFromValue(const Value& value);
-
-Value listminting(const Array& params, bool fHelp)
+void listminting(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if(fHelp || params.size() > 2)
         throw runtime_error(
                 "listminting [count=-1] [from=0]\n"
-                "Return all mintable outputs and provide details for each of them.");
+                "Return all mintable outputs and provide details for each of them.\n"
+                "Skips the first [from] outputs and returns at most [count] of them.");
 
     int64 count = -1;
     if(params.size() > 0)
@@ -25,62 +26,69 @@ Value listminting(const Array& params, bool fHelp)
     if(params.size() > 1)
         from = params[1].get_int();
 
-    Array ret;
-
-    const CBlockIndex *p = GetLastBlockIndex(pindexBest, true);
-    double difficulty = p->GetBlockDifficulty();
+    double difficulty = KernelRecord::getLastProofOfStakeDifficulty();
+    int minAge = nStakeMinAge / 60 / 60 / 24;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    // Collect the outputs and their accounts under the locks; writing them
+    // out may wait for the client
+    std::vector<KernelRecord> vRecords;
+    std::vector<string> vAccounts;
     {
-
-        std::vector<KernelRecord> txList = KernelRecord::decomposeOutput(pwalletMain, it->second);
-        int minAge = nStakeMinAge / 60 / 60 / 24;
-        BOOST_FOREACH(KernelRecord& kr, txList) {
-            if(!kr.spent) {
-
-                if(count > 0 && ret.size() >= count) {
-                    break;
-                }
-
-                string strTime = boost::lexical_cast<std::string>(kr.nTime);
-                string strAmount = boost::lexical_cast<std::string>(kr.nValue);
-                string strAge = boost::lexical_cast<std::string>(kr.getAge());
-                string strCoinAge = boost::lexical_cast<std::string>(kr.coinAge);
-
-                Array params;
-                params.push_back(kr.address);
-                string account = AccountFromValue(getaccount(params, false));
-
-                string status = "immature";
-                int searchInterval = 0;
-                int attemps = 0;
-                if(kr.getAge() >=  minAge)
-                {
-                    status = "mature";
-                    searchInterval = (int)nLastCoinStakeSearchInterval;
-                    attemps = GetAdjustedTime() - kr.nTime - nStakeMinAge;
-                }
-
-                Object obj;
-                obj.push_back(Pair("account",                   account));
-                obj.push_back(Pair("address",                   kr.address));
-                obj.push_back(Pair("input-txid",                kr.hash.ToString()));
-                obj.push_back(Pair("time",                      strTime));
-                obj.push_back(Pair("amount",                    strAmount));
-                obj.push_back(Pair("status",                    status));
-                obj.push_back(Pair("age-in-day",                strAge));
-                obj.push_back(Pair("coin-day-weight",           strCoinAge));
-                obj.push_back(Pair("proof-of-stake-difficulty", difficulty));
-                obj.push_back(Pair("minting-probability-10min", kr.getProbToMintWithinNMinutes(difficulty, 10)));
-                obj.push_back(Pair("minting-probability-24h",   kr.getProbToMintWithinNMinutes(difficulty, 60*24)));
-                obj.push_back(Pair("minting-probability-30d",   kr.getProbToMintWithinNMinutes(difficulty, 60*24*30)));
-                obj.push_back(Pair("minting-probability-90d",   kr.getProbToMintWithinNMinutes(difficulty, 60*24*90)));
-                obj.push_back(Pair("search-interval-in-sec",    searchInterval));
-                obj.push_back(Pair("attempts",                  attemps));
-                ret.push_back(obj);
-            }
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        KernelRecord::decomposeCoins(pwalletMain, vRecords);
+
+        vRecords.erase(vRecords.begin(), vRecords.begin() + min((size_t)max(from, (int64)0), vRecords.size()));
+        if (count > 0 && (int64)vRecords.size() > count)
+            vRecords.resize(count);
+
+        vAccounts.resize(vRecords.size());
+        for (unsigned int i = 0; i < vRecords.size(); i++)
+        {
+            CBitcoinAddress address(vRecords[i].address);
+            if (!address.IsValid())
+                continue;
+            map<CTxDestination, string>::const_iterator mi = pwalletMain->mapAddressBook.find(address.Get());
+            if (mi != pwalletMain->mapAddressBook.end())
+                vAccounts[i] = mi->second;
         }
     }
 
-    return ret;
+    writer.BeginArray();
+    for (unsigned int i = 0; i < vRecords.size(); i++)
+    {
+        KernelRecord& kr = vRecords[i];
+        string strTime = boost::lexical_cast<std::string>(kr.nTime);
+        string strAmount = boost::lexical_cast<std::string>(kr.nValue);
+        string strAge = boost::lexical_cast<std::string>(kr.getAge());
+        string strCoinAge = boost::lexical_cast<std::string>(kr.coinAge);
+
+        string status = "immature";
+        int searchInterval = 0;
+        int attemps = 0;
+        if(kr.getAge() >=  minAge)
+        {
+            status = "mature";
+            searchInterval = (int)nLastCoinStakeSearchInterval;
+            attemps = GetAdjustedTime() - kr.nTime - nStakeMinAge;
+        }
+
+        writer.BeginObject();
+        writer.Pair("account",                   vAccounts[i]);
+        writer.Pair("address",                   kr.address);
+        writer.Pair("input-txid",                kr.hash.ToString());
+        writer.Pair("time",                      strTime);
+        writer.Pair("amount",                    strAmount);
+        writer.Pair("status",                    status);
+        writer.Pair("age-in-day",                strAge);
+        writer.Pair("coin-day-weight",           strCoinAge);
+        writer.Pair("proof-of-stake-difficulty", difficulty);
+        writer.Pair("minting-probability-10min", kr.getProbToMintWithinNMinutes(difficulty, 10));
+        writer.Pair("minting-probability-24h",   kr.getProbToMintWithinNMinutes(difficulty, 60*24));
+        writer.Pair("minting-probability-30d",   kr.getProbToMintWithinNMinutes(difficulty, 60*24*30));
+        writer.Pair("minting-probability-90d",   kr.getProbToMintWithinNMinutes(difficulty, 60*24*90));
+        writer.Pair("search-interval-in-sec",    searchInterval);
+        writer.Pair("attempts",                  attemps);
+        writer.EndObject();
+    }
+    writer.EndArray();
 }
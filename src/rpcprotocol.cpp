@@ -7,6 +7,7 @@
 
 #include "util.h"
 
+#include <limits>
 #include <stdint.h>
 
 #include <boost/algorithm/string.hpp>
@@ -65,7 +66,18 @@ static string rfc1123Time()
     return string(buffer);
 }
 
-string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
+static const char* HTTPStatusText(int nStatus)
+{
+    if (nStatus == HTTP_OK) return "OK";
+    if (nStatus == HTTP_BAD_REQUEST) return "Bad Request";
+    if (nStatus == HTTP_FORBIDDEN) return "Forbidden";
+    if (nStatus == HTTP_NOT_FOUND) return "Not Found";
+    if (nStatus == HTTP_INTERNAL_SERVER_ERROR) return "Internal Server Error";
+    if (nStatus == HTTP_SERVICE_UNAVAILABLE) return "Service Unavailable";
+    return "";
+}
+
+string HTTPReply(int nStatus, const string& strMsg, bool keepalive, const char* pszContentType)
 {
     if (nStatus == HTTP_UNAUTHORIZED)
         return strprintf("HTTP/1.0 401 Authorization Required\r\n"
@@ -84,29 +96,93 @@ string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
             "</HEAD>\r\n"
             "<BODY><H1>401 Unauthorized.</H1></BODY>\r\n"
             "</HTML>\r\n", rfc1123Time().c_str(), FormatFullVersion().c_str());
-    const char *cStatus;
-         if (nStatus == HTTP_OK) cStatus = "OK";
-    else if (nStatus == HTTP_BAD_REQUEST) cStatus = "Bad Request";
-    else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
-    else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
-    else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
-    else cStatus = "";
+    return HTTPReplyHeader(nStatus, keepalive, strMsg.size(), pszContentType) + strMsg;
+}
+
+string HTTPReplyHeader(int nStatus, bool keepalive, size_t nContentLength, const char* pszContentType)
+{
     return strprintf(
             "HTTP/1.1 %d %s\r\n"
             "Date: %s\r\n"
             "Connection: %s\r\n"
             "Content-Length: %" PRIszu"\r\n"
+            "Content-Type: %s\r\n"
+            "Server: ppcoin-json-rpc/%s\r\n"
+            "\r\n",
+        nStatus,
+        HTTPStatusText(nStatus),
+        rfc1123Time().c_str(),
+        keepalive ? "keep-alive" : "close",
+        nContentLength,
+        pszContentType,
+        FormatFullVersion().c_str());
+}
+
+string HTTPReplyChunkedHeader(int nStatus, bool keepalive)
+{
+    return strprintf(
+            "HTTP/1.1 %d %s\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "Transfer-Encoding: chunked\r\n"
             "Content-Type: application/json\r\n"
             "Server: ppcoin-json-rpc/%s\r\n"
-            "\r\n"
-            "%s",
+            "\r\n",
         nStatus,
-        cStatus,
+        HTTPStatusText(nStatus),
         rfc1123Time().c_str(),
         keepalive ? "keep-alive" : "close",
-        strMsg.size(),
-        FormatFullVersion().c_str(),
-        strMsg.c_str());
+        FormatFullVersion().c_str());
+}
+
+CHTTPChunkedStreamBuf::CHTTPChunkedStreamBuf(std::ostream& osIn, const string& strHeaderIn, size_t nChunkSize) :
+    os(osIn), strHeader(strHeaderIn), vBuf(nChunkSize), fStarted(false)
+{
+    setp(&vBuf[0], &vBuf[0] + vBuf.size());
+}
+
+bool CHTTPChunkedStreamBuf::SendChunk()
+{
+    if (!fStarted)
+    {
+        os << strHeader;
+        fStarted = true;
+    }
+    std::ptrdiff_t n = pptr() - pbase();
+    if (n > 0)
+    {
+        os << strprintf("%x\r\n", (unsigned int)n);
+        os.write(pbase(), n);
+        os << "\r\n";
+    }
+    setp(&vBuf[0], &vBuf[0] + vBuf.size());
+    return os.good();
+}
+
+int CHTTPChunkedStreamBuf::overflow(int c)
+{
+    if (!SendChunk())
+        return traits_type::eof();
+    if (c != traits_type::eof())
+    {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+int CHTTPChunkedStreamBuf::sync()
+{
+    // Chunks are sent when full, not on every flush
+    return 0;
+}
+
+bool CHTTPChunkedStreamBuf::Finish()
+{
+    if (!SendChunk())
+        return false;
+    os << "0\r\n\r\n" << std::flush;
+    return os.good();
 }
 
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
@@ -190,7 +266,7 @@ int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
                     int nProto)
 {
     mapHeadersRet.clear();
-    strMessageRet = "";
+    strMessageRet.clear();
 
     // Read header
     int nLen = ReadHTTPHeaders(stream, mapHeadersRet);
@@ -198,11 +274,30 @@ int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
         return HTTP_INTERNAL_SERVER_ERROR;
 
     // Read message
-    if (nLen > 0)
+    if (boost::iequals(mapHeadersRet["transfer-encoding"], "chunked"))
+    {
+        while (true)
+        {
+            string str;
+            std::getline(stream, str);
+            int nChunk = (int)strtol(str.c_str(), NULL, 16);
+            if (!stream || nChunk < 0 || strMessageRet.size() + nChunk > MAX_SIZE)
+                return HTTP_INTERNAL_SERVER_ERROR;
+            if (nChunk == 0)
+                break;
+            size_t nPos = strMessageRet.size();
+            strMessageRet.resize(nPos + nChunk);
+            stream.read(&strMessageRet[nPos], nChunk);
+            std::getline(stream, str);
+        }
+        // Trailer
+        map<string, string> mapTrailer;
+        ReadHTTPHeaders(stream, mapTrailer);
+    }
+    else if (nLen > 0)
     {
-        vector<char> vch(nLen);
-        stream.read(&vch[0], nLen);
-        strMessageRet = string(vch.begin(), vch.end());
+        strMessageRet.resize(nLen);
+        stream.read(&strMessageRet[0], nLen);
     }
 
     string sConHdr = mapHeadersRet["connection"];
@@ -218,6 +313,280 @@ int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
     return HTTP_OK;
 }
 
+//
+// JSON parser for RPC messages. It reads JSON into the same values as
+// json_spirit's read_string, but without Boost.Spirit's per-character
+// overhead and without copying arrays and objects as they are built.
+//
+
+class CJSONReader
+{
+public:
+    CJSONReader(const string& str) : p(str.data()), pend(str.data() + str.size()), nDepth(0) {}
+
+    bool Read(Value& valueRet)
+    {
+        SkipSpace();
+        // Like read_string, ignore what follows the value
+        return ReadValue(valueRet);
+    }
+
+private:
+    const char* p;
+    const char* pend;
+    int nDepth;
+
+    static const int MAX_DEPTH = 512;
+
+    void SkipSpace()
+    {
+        while (p < pend && isspace((unsigned char)*p))
+            p++;
+    }
+
+    bool Consume(const char* pszWord)
+    {
+        const char* q = p;
+        for (; *pszWord; pszWord++, q++)
+            if (q >= pend || *q != *pszWord)
+                return false;
+        p = q;
+        return true;
+    }
+
+    bool ReadValue(Value& value)
+    {
+        if (p >= pend)
+            return false;
+        switch (*p)
+        {
+        case '{': return ReadObject(value);
+        case '[': return ReadArray(value);
+        case '"':
+        {
+            string str;
+            if (!ReadString(str))
+                return false;
+            value = Value(str);
+            return true;
+        }
+        case 't': value = Value(true); return Consume("true");
+        case 'f': value = Value(false); return Consume("false");
+        case 'n': value = Value(); return Consume("null");
+        default: return ReadNumber(value);
+        }
+    }
+
+    bool ReadObject(Value& value)
+    {
+        if (++nDepth > MAX_DEPTH)
+            return false;
+        p++;
+        value = Object();
+        Object& obj = value.get_obj();
+        SkipSpace();
+        if (p < pend && *p == '}')
+        {
+            p++;
+            nDepth--;
+            return true;
+        }
+        while (true)
+        {
+            if (p >= pend || *p != '"')
+                return false;
+            obj.push_back(Pair(string(), Value()));
+            if (!ReadString(obj.back().name_))
+                return false;
+            SkipSpace();
+            if (p >= pend || *p != ':')
+                return false;
+            p++;
+            SkipSpace();
+            if (!ReadValue(obj.back().value_))
+                return false;
+            SkipSpace();
+            if (p < pend && *p == ',')
+            {
+                p++;
+                SkipSpace();
+                continue;
+            }
+            if (p < pend && *p == '}')
+            {
+                p++;
+                nDepth--;
+                return true;
+            }
+            return false;
+        }
+    }
+
+    bool ReadArray(Value& value)
+    {
+        if (++nDepth > MAX_DEPTH)
+            return false;
+        p++;
+        value = Array();
+        Array& arr = value.get_array();
+        SkipSpace();
+        if (p < pend && *p == ']')
+        {
+            p++;
+            nDepth--;
+            return true;
+        }
+        while (true)
+        {
+            arr.push_back(Value());
+            if (!ReadValue(arr.back()))
+                return false;
+            SkipSpace();
+            if (p < pend && *p == ',')
+            {
+                p++;
+                SkipSpace();
+                continue;
+            }
+            if (p < pend && *p == ']')
+            {
+                p++;
+                nDepth--;
+                return true;
+            }
+            return false;
+        }
+    }
+
+    static int HexDigit(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return 0;
+    }
+
+    // Escapes are decoded as json_spirit does: \u and \x give a single
+    // char, unknown escapes are dropped
+    bool ReadString(string& str)
+    {
+        p++;
+        str.clear();
+        while (true)
+        {
+            const char* q = p;
+            while (q < pend && *q != '"' && *q != '\\')
+                q++;
+            if (q >= pend)
+                return false;
+            str.append(p, q);
+            p = q + 1;
+            if (*q == '"')
+                return true;
+
+            if (p >= pend)
+                return false;
+            char c = *p++;
+            switch (c)
+            {
+            case 't': str += '\t'; break;
+            case 'b': str += '\b'; break;
+            case 'f': str += '\f'; break;
+            case 'n': str += '\n'; break;
+            case 'r': str += '\r'; break;
+            case 'x':
+                if (pend - p < 3)
+                    return false;
+                str += (char)((HexDigit(p[0]) << 4) + HexDigit(p[1]));
+                p += 2;
+                break;
+            case 'u':
+                if (pend - p < 5)
+                    return false;
+                str += (char)((HexDigit(p[0]) << 12) + (HexDigit(p[1]) << 8) + (HexDigit(p[2]) << 4) + HexDigit(p[3]));
+                p += 4;
+                break;
+            case '\\':
+            case '/':
+            case '"':
+                str += c;
+                break;
+            }
+        }
+    }
+
+    bool ReadNumber(Value& value)
+    {
+        const char* pstart = p;
+        bool fNegative = false;
+        if (p < pend && (*p == '-' || *p == '+'))
+            fNegative = (*p++ == '-');
+
+        // Integer part, checked for overflow as it is read
+        const char* pdigits = p;
+        boost::uint64_t n = 0;
+        bool fOverflow = false;
+        for (; p < pend && *p >= '0' && *p <= '9'; p++)
+        {
+            unsigned int nDigit = *p - '0';
+            if (n > (std::numeric_limits<boost::uint64_t>::max() - nDigit) / 10)
+                fOverflow = true;
+            n = n * 10 + nDigit;
+        }
+        bool fDigits = (p > pdigits);
+
+        // A fraction or exponent makes it a real
+        bool fReal = false;
+        if (p < pend && *p == '.')
+        {
+            fReal = true;
+            for (p++; p < pend && *p >= '0' && *p <= '9'; p++)
+                fDigits = true;
+        }
+        if (fDigits && p < pend && (*p == 'e' || *p == 'E'))
+        {
+            const char* pexp = p++;
+            if (p < pend && (*p == '-' || *p == '+'))
+                p++;
+            if (p < pend && *p >= '0' && *p <= '9')
+            {
+                fReal = true;
+                while (p < pend && *p >= '0' && *p <= '9')
+                    p++;
+            }
+            else
+                p = pexp;
+        }
+        if (!fDigits)
+            return false;
+
+        if (fReal)
+        {
+            value = Value(strtod(string(pstart, p).c_str(), NULL));
+            return true;
+        }
+        if (fOverflow)
+            return false;
+        if (fNegative)
+        {
+            if (n > (boost::uint64_t)std::numeric_limits<boost::int64_t>::max() + 1)
+                return false;
+            value = Value((boost::int64_t)(0 - n));
+        }
+        else if (n > (boost::uint64_t)std::numeric_limits<boost::int64_t>::max())
+            value = Value(n);
+        else
+            value = Value((boost::int64_t)n);
+        return true;
+    }
+};
+
+bool ReadJSON(const string& strJSON, Value& valueRet)
+{
+    CJSONReader reader(strJSON);
+    return reader.Read(valueRet);
+}
+
 //
 // JSON-RPC protocol.  Bitcoin speaks version 1.0 for maximum compatibility,
 // but uses JSON-RPC 1.1/2.0 standards for parts of the 1.0 standard that were
@@ -255,6 +624,98 @@ string JSONRPCReply(const Value& result, const Value& error, const Value& id)
     return write_string(Value(reply), false) + "\n";
 }
 
+void CJSONStreamWriter::Separate()
+{
+    if (fAfterKey)
+        fAfterKey = false;
+    else if (!vEmpty.empty())
+    {
+        if (!vEmpty.back())
+            os << ',';
+        vEmpty.back() = false;
+    }
+}
+
+void CJSONStreamWriter::BeginObject()
+{
+    Separate();
+    os << '{';
+    vEmpty.push_back(true);
+}
+
+void CJSONStreamWriter::EndObject()
+{
+    vEmpty.pop_back();
+    os << '}';
+}
+
+void CJSONStreamWriter::BeginArray()
+{
+    Separate();
+    os << '[';
+    vEmpty.push_back(true);
+}
+
+void CJSONStreamWriter::EndArray()
+{
+    vEmpty.pop_back();
+    os << ']';
+}
+
+void CJSONStreamWriter::Key(const string& strKey)
+{
+    Separate();
+    os << '"' << add_esc_chars(strKey) << "\":";
+    fAfterKey = true;
+}
+
+void CJSONStreamWriter::WriteValue(const Value& value)
+{
+    Separate();
+    write_stream(value, os, false);
+}
+
+void CJSONValueWriter::BeginObject()
+{
+    vLevels.push_back(Level());
+    vLevels.back().fObject = true;
+}
+
+void CJSONValueWriter::EndObject()
+{
+    Value value(vLevels.back().obj);
+    vLevels.pop_back();
+    WriteValue(value);
+}
+
+void CJSONValueWriter::BeginArray()
+{
+    vLevels.push_back(Level());
+    vLevels.back().fObject = false;
+}
+
+void CJSONValueWriter::EndArray()
+{
+    Value value(vLevels.back().arr);
+    vLevels.pop_back();
+    WriteValue(value);
+}
+
+void CJSONValueWriter::Key(const string& strKey)
+{
+    vLevels.back().strKey = strKey;
+}
+
+void CJSONValueWriter::WriteValue(const Value& value)
+{
+    if (vLevels.empty())
+        result = value;
+    else if (vLevels.back().fObject)
+        vLevels.back().obj.push_back(json_spirit::Pair(vLevels.back().strKey, value));
+    else
+        vLevels.back().arr.push_back(value);
+}
+
 Object JSONRPCError(int code, const string& message)
 {
     Object error;
@@ -8,8 +8,11 @@
 
 #include <list>
 #include <map>
+#include <ostream>
 #include <stdint.h>
+#include <streambuf>
 #include <string>
+#include <vector>
 #include <boost/iostreams/concepts.hpp>
 #include <boost/iostreams/stream.hpp>
 #include <boost/asio.hpp>
@@ -28,6 +31,7 @@ enum HTTPStatusCode
     HTTP_FORBIDDEN             = 403,
     HTTP_NOT_FOUND             = 404,
     HTTP_INTERNAL_SERVER_ERROR = 500,
+    HTTP_SERVICE_UNAVAILABLE   = 503,
 };
 
 // Bitcoin RPC error codes
@@ -87,6 +91,11 @@ public:
         fNeedHandshake = false;
         stream.handshake(role);
     }
+    // The handshake was done asynchronously by the owner of the stream
+    void handshake_done()
+    {
+        fNeedHandshake = false;
+    }
     std::streamsize read(char* s, std::streamsize n)
     {
         handshake(boost::asio::ssl::stream_base::server); // HTTPS servers read first
@@ -122,14 +131,116 @@ private:
     boost::asio::ssl::stream<typename Protocol::socket>& stream;
 };
 
+/**
+ * Output stream buffer that sends what is written to it as HTTP/1.1 chunks,
+ * after the reply header strHeader. Nothing is sent until the first chunk
+ * is full, so a reply that fails early can still be replaced by an error.
+ */
+class CHTTPChunkedStreamBuf : public std::streambuf
+{
+public:
+    CHTTPChunkedStreamBuf(std::ostream& osIn, const std::string& strHeaderIn, size_t nChunkSize = 65536);
+
+    // Whether part of the reply has been sent
+    bool Started() const { return fStarted; }
+    // Send what is left and the last chunk
+    bool Finish();
+
+protected:
+    int overflow(int c);
+    int sync();
+
+private:
+    std::ostream& os;
+    std::string strHeader;
+    std::vector<char> vBuf;
+    bool fStarted;
+
+    bool SendChunk();
+};
+
+/**
+ * Writes JSON a token at a time, so that large RPC results can be produced
+ * without building a json_spirit::Value tree first.
+ */
+class CJSONWriter
+{
+public:
+    virtual ~CJSONWriter() {}
+    virtual void BeginObject() = 0;
+    virtual void EndObject() = 0;
+    virtual void BeginArray() = 0;
+    virtual void EndArray() = 0;
+    // Name of the next value written inside an object
+    virtual void Key(const std::string& strKey) = 0;
+    virtual void WriteValue(const json_spirit::Value& value) = 0;
+
+    void Pair(const std::string& strKey, const json_spirit::Value& value)
+    {
+        Key(strKey);
+        WriteValue(value);
+    }
+};
+
+/** CJSONWriter that writes JSON text to a stream, as write_string would */
+class CJSONStreamWriter : public CJSONWriter
+{
+public:
+    CJSONStreamWriter(std::ostream& osIn) : os(osIn), fAfterKey(false) {}
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    void Key(const std::string& strKey);
+    void WriteValue(const json_spirit::Value& value);
+
+private:
+    std::ostream& os;
+    // per open object or array: whether nothing was written in it yet
+    std::vector<bool> vEmpty;
+    bool fAfterKey;
+
+    void Separate();
+};
+
+/** CJSONWriter that builds a json_spirit::Value, for callers that need one */
+class CJSONValueWriter : public CJSONWriter
+{
+public:
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    void Key(const std::string& strKey);
+    void WriteValue(const json_spirit::Value& value);
+
+    const json_spirit::Value& GetValue() const { return result; }
+
+private:
+    struct Level
+    {
+        bool fObject;
+        json_spirit::Object obj;
+        json_spirit::Array arr;
+        std::string strKey;
+    };
+    std::vector<Level> vLevels;
+    json_spirit::Value result;
+};
+
 std::string HTTPPost(const std::string& strMsg, const std::map<std::string,std::string>& mapRequestHeaders);
-std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive);
+std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive, const char* pszContentType = "application/json");
+// Header of a reply whose body of nContentLength bytes is sent by the caller
+std::string HTTPReplyHeader(int nStatus, bool keepalive, size_t nContentLength, const char* pszContentType = "application/json");
+std::string HTTPReplyChunkedHeader(int nStatus, bool keepalive);
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
                          std::string& http_method, std::string& http_uri);
 int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto);
 int ReadHTTPHeaders(std::basic_istream<char>& stream, std::map<std::string, std::string>& mapHeadersRet);
 int ReadHTTPMessage(std::basic_istream<char>& stream, std::map<std::string, std::string>& mapHeadersRet,
                     std::string& strMessageRet, int nProto);
+bool ReadJSON(const std::string& strJSON, json_spirit::Value& valueRet);
 std::string JSONRPCRequest(const std::string& strMethod, const json_spirit::Array& params, const json_spirit::Value& id);
 json_spirit::Object JSONRPCReplyObj(const json_spirit::Value& result, const json_spirit::Value& error, const json_spirit::Value& id);
 std::string JSONRPCReply(const json_spirit::Value& result, const json_spirit::Value& error, const json_spirit::Value& id);
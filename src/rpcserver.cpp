@@ -29,6 +29,8 @@
 #include <boost/iostreams/stream.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <deque>
 #include <list>
 
 using namespace std;
@@ -49,6 +51,80 @@ static map<string, boost::shared_ptr<deadline_timer> > deadlineTimers;
 static ssl::context* rpc_ssl_context = NULL;
 static boost::thread_group* rpc_worker_group = NULL;
 
+// Connections with a complete request, waiting for an RPC worker. At most
+// nRPCWorkQueueDepth (-rpcworkqueue) requests wait, others get a 503.
+// Idle workers also help with JSON-RPC batches that have requests nobody
+// has started yet, see CRPCBatch; mutexRPCWork guards both queues.
+class AcceptedConnection;
+class CRPCBatch;
+static boost::mutex mutexRPCWork;
+static boost::condition_variable condRPCWork;
+static std::deque<boost::shared_ptr<AcceptedConnection> > dequeRPCWork;
+static std::deque<boost::shared_ptr<CRPCBatch> > dequeRPCBatches;
+static size_t nRPCWorkQueueDepth = 16;
+
+// Open connections, at most nRPCMaxConnections (-rpcmaxconnections). Each
+// has nRPCReadTimeout (-rpcreadtimeout) seconds to send a complete request,
+// or, when kept alive, its next one.
+static boost::mutex mutexRPCConnections;
+static int nRPCConnections = 0;
+static int nRPCMaxConnections = 64;
+static int nRPCReadTimeout = 30;
+
+// Room for the request line and headers in a connection's input buffer
+static const size_t RPC_MAX_HEADER_SIZE = 65536;
+
+/**
+ * Call counts and latency histograms of an RPC method. Times are in
+ * microseconds. The wait is for the locks the method declares, the
+ * execution time includes writing a streamed result to the client.
+ */
+class CRPCMethodStats
+{
+public:
+    // Histogram buckets: < 100us, < 1ms, < 10ms, < 100ms, < 1s, < 10s, < 100s, more
+    static const int HISTOGRAM_BUCKETS = 8;
+
+    int64 nCalls;
+    int64 nErrors;
+    int64 nWaitTotal;
+    int64 nWaitMax;
+    int64 nExecTotal;
+    int64 nExecMax;
+    int64 vWaitHistogram[HISTOGRAM_BUCKETS];
+    int64 vExecHistogram[HISTOGRAM_BUCKETS];
+
+    CRPCMethodStats() : nCalls(0), nErrors(0), nWaitTotal(0), nWaitMax(0), nExecTotal(0), nExecMax(0)
+    {
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+            vWaitHistogram[i] = vExecHistogram[i] = 0;
+    }
+
+    static int Bucket(int64 nMicros)
+    {
+        int nBucket = 0;
+        for (int64 nLimit = 100; nMicros >= nLimit && nBucket < HISTOGRAM_BUCKETS - 1; nLimit *= 10)
+            nBucket++;
+        return nBucket;
+    }
+
+    void Add(int64 nWait, int64 nExec, bool fError)
+    {
+        nCalls++;
+        if (fError)
+            nErrors++;
+        nWaitTotal += nWait;
+        nWaitMax = std::max(nWaitMax, nWait);
+        nExecTotal += nExec;
+        nExecMax = std::max(nExecMax, nExec);
+        vWaitHistogram[Bucket(nWait)]++;
+        vExecHistogram[Bucket(nExec)]++;
+    }
+};
+
+static boost::mutex mutexRPCStats;
+static map<string, CRPCMethodStats> mapRPCStats;
+
 static inline unsigned short GetDefaultRPCPort()
 {
     return GetBoolArg("-testnet", false) ? TESTNET_RPC_PORT : RPC_PORT;
@@ -237,6 +313,7 @@ string CRPCTable::help(string strCommand) const
 {
     string strRet;
     set<rpcfn_type> setDone;
+    set<rpcstreamfn_type> setStreamDone;
     for (map<string, const CRPCCommand*>::const_iterator mi = mapCommands.begin(); mi != mapCommands.end(); ++mi)
     {
         const CRPCCommand *pcmd = mi->second;
@@ -250,7 +327,13 @@ string CRPCTable::help(string strCommand) const
         {
             Array params;
             rpcfn_type pfn = pcmd->actor;
-            if (setDone.insert(pfn).second)
+            if (!pfn)
+            {
+                CJSONValueWriter writer;
+                if (setStreamDone.insert(pcmd->streamer).second)
+                    (*pcmd->streamer)(params, true, writer);
+            }
+            else if (setDone.insert(pfn).second)
                 (*pfn)(params, true);
         }
         catch (std::exception& e)
@@ -296,6 +379,79 @@ Value stop(const Array& params, bool fHelp)
 }
 
 
+static Object RPCTimesToJSON(int64 nTotal, int64 nMax, int64 nCalls, const int64* pHistogram, int nBuckets)
+{
+    Object obj;
+    obj.push_back(Pair("total_ms", nTotal / 1000.0));
+    obj.push_back(Pair("avg_ms", nCalls ? nTotal / 1000.0 / nCalls : 0.0));
+    obj.push_back(Pair("max_ms", nMax / 1000.0));
+    Array histogram;
+    for (int i = 0; i < nBuckets; i++)
+        histogram.push_back((boost::int64_t)pHistogram[i]);
+    obj.push_back(Pair("histogram", histogram));
+    return obj;
+}
+
+Value getrpcstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getrpcstats [reset=false]\n"
+            "Returns the number of calls and errors of each RPC method since startup,\n"
+            "and the time spent waiting for its locks and running. The histograms\n"
+            "count calls that took < 0.1ms, < 1ms, < 10ms, < 100ms, < 1s, < 10s, < 100s and more.\n"
+            "With reset true, the statistics are cleared after they are returned.");
+
+    map<string, CRPCMethodStats> mapStats;
+    {
+        boost::unique_lock<boost::mutex> lock(mutexRPCStats);
+        mapStats = mapRPCStats;
+        if (params.size() > 0 && params[0].get_bool())
+            mapRPCStats.clear();
+    }
+
+    Object ret;
+    for (map<string, CRPCMethodStats>::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it)
+    {
+        const CRPCMethodStats& stats = it->second;
+        Object obj;
+        obj.push_back(Pair("calls", (boost::int64_t)stats.nCalls));
+        obj.push_back(Pair("errors", (boost::int64_t)stats.nErrors));
+        obj.push_back(Pair("lockwait", RPCTimesToJSON(stats.nWaitTotal, stats.nWaitMax, stats.nCalls, stats.vWaitHistogram, CRPCMethodStats::HISTOGRAM_BUCKETS)));
+        obj.push_back(Pair("exec", RPCTimesToJSON(stats.nExecTotal, stats.nExecMax, stats.nCalls, stats.vExecHistogram, CRPCMethodStats::HISTOGRAM_BUCKETS)));
+        ret.push_back(Pair(it->first, obj));
+    }
+    return ret;
+}
+
+Value getlockstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getlockstats [reset=false]\n"
+            "Returns how long each lock site waited for its lock and held it, sorted by\n"
+            "total hold time. Locks are only profiled when started with -lockprofile.\n"
+            "The histograms count locks that took < 1us, < 10us, < 100us, < 1ms, < 10ms,\n"
+            "< 100ms, < 1s and more. With reset true, the statistics are cleared after\n"
+            "they are returned.");
+
+    vector<CLockSiteStats> vStats;
+    GetLockProfile(vStats, params.size() > 0 && params[0].get_bool());
+
+    Array ret;
+    BOOST_FOREACH(const CLockSiteStats& stats, vStats)
+    {
+        Object obj;
+        obj.push_back(Pair("lock", stats.pszName));
+        obj.push_back(Pair("site", strprintf("%s:%d", stats.pszFile, stats.nLine)));
+        obj.push_back(Pair("locks", (boost::int64_t)stats.nLocks));
+        obj.push_back(Pair("wait", RPCTimesToJSON(stats.nWaitTotal, stats.nWaitMax, stats.nLocks, stats.vWaitHistogram, CLockSiteStats::HISTOGRAM_BUCKETS)));
+        obj.push_back(Pair("hold", RPCTimesToJSON(stats.nHoldTotal, stats.nHoldMax, stats.nLocks, stats.vHoldHistogram, CLockSiteStats::HISTOGRAM_BUCKETS)));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
 
 #ifdef TESTING
 
@@ -413,97 +569,104 @@ Value ignorenextblock(const Array& params, bool fHelp)
 
 
 static const CRPCCommand vRPCCommands[] =
-{ //  name                      actor (function)         okSafeMode threadSafe
-  //  ------------------------  -----------------------  ---------- ----------
-    { "help",                   &help,                   true,      true },
-    { "stop",                   &stop,                   true,      true },
-    { "getblockcount",          &getblockcount,          true,      false },
-    { "getconnectioncount",     &getconnectioncount,     true,      false },
-    { "getpeerinfo",            &getpeerinfo,            true,      false },
-    { "addnode",                &addnode,                true,      true },
-    { "getaddednodeinfo",       &getaddednodeinfo,       true,      true },
-    { "getdifficulty",          &getdifficulty,          true,      false },
-    { "getgenerate",            &getgenerate,            true,      false },
+{ //  name                      actor (function)         okSafeMode locks            streamer
+  //  ------------------------  -----------------------  ---------- ---------------  ----------------
+    { "help",                   &help,                   true,      RPC_LOCK_NONE,   NULL },
+    { "stop",                   &stop,                   true,      RPC_LOCK_NONE,   NULL },
+    { "getrpcstats",            &getrpcstats,            true,      RPC_LOCK_NONE,   NULL },
+    { "getlockstats",           &getlockstats,           true,      RPC_LOCK_NONE,   NULL },
+    { "getblockcount",          &getblockcount,          true,      RPC_LOCK_NONE,   NULL },
+    { "getconnectioncount",     &getconnectioncount,     true,      RPC_LOCK_NONE,   NULL },
+    { "getpeerinfo",            &getpeerinfo,            true,      RPC_LOCK_NONE,   NULL },
+    { "addnode",                &addnode,                true,      RPC_LOCK_NONE,   NULL },
+    { "getaddednodeinfo",       &getaddednodeinfo,       true,      RPC_LOCK_NONE,   NULL },
+    { "getdifficulty",          &getdifficulty,          true,      RPC_LOCK_NONE,   NULL },
+    { "getgenerate",            &getgenerate,            true,      RPC_LOCK_ALL,    NULL },
 #ifndef DISABLE_MINING
-    { "setgenerate",            &setgenerate,            true,      false },
-    { "gethashespersec",        &gethashespersec,        true,      false },
+    { "setgenerate",            &setgenerate,            true,      RPC_LOCK_ALL,    NULL },
+    { "gethashespersec",        &gethashespersec,        true,      RPC_LOCK_ALL,    NULL },
 #endif // DISABLE_MINING
-    { "getnetworkghps",         &getnetworkghps,         true,      false },
-    { "getinfo",                &getinfo,                true,      false },
-    { "getmininginfo",          &getmininginfo,          true,      false },
-    { "getnewaddress",          &getnewaddress,          true,      false },
-    { "getaccountaddress",      &getaccountaddress,      true,      false },
-    { "setaccount",             &setaccount,             true,      false },
-    { "getaccount",             &getaccount,             false,     false },
-    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,      false },
-    { "sendtoaddress",          &sendtoaddress,          false,     false },
-    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,     false },
-    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,     false },
-    { "listminting",            &listminting,            false,     false },
-    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,     false },
-    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,     false },
-    { "backupwallet",           &backupwallet,           true,      false },
-    { "keypoolrefill",          &keypoolrefill,          true,      false },
-    { "walletpassphrase",       &walletpassphrase,       true,      false },
-    { "walletpassphrasechange", &walletpassphrasechange, false,     false },
-    { "walletlock",             &walletlock,             true,      false },
-    { "encryptwallet",          &encryptwallet,          false,     false },
-    { "validateaddress",        &validateaddress,        true,      false },
-    { "getbalance",             &getbalance,             false,     false },
-    { "move",                   &movecmd,                false,     false },
-    { "sendfrom",               &sendfrom,               false,     false },
-    { "sendmany",               &sendmany,               false,     false },
-    { "addmultisigaddress",     &addmultisigaddress,     false,     false },
-    { "createmultisig",         &createmultisig,         true,      true  },
-    { "getrawmempool",          &getrawmempool,          true,      false },
-    { "getblock",               &getblock,               false,     false },
-    { "getblockhash",           &getblockhash,           false,     false },
-    { "getbestblockhash",       &getbestblockhash,       false,     false },
-    { "gettransaction",         &gettransaction,         false,     false },
-    { "estimatefee",            &estimatefee,            true,      true  },
-    { "listtransactions",       &listtransactions,       false,     false },
-    { "listaddressgroupings",   &listaddressgroupings,   false,     false },
-    { "signmessage",            &signmessage,            false,     false },
-    { "verifymessage",          &verifymessage,          false,     false },
+    { "getnetworkghps",         &getnetworkghps,         true,      RPC_LOCK_MAIN,   NULL },
+    { "getinfo",                &getinfo,                true,      RPC_LOCK_ALL,    NULL },
+    { "getmininginfo",          &getmininginfo,          true,      RPC_LOCK_ALL,    NULL },
+    { "getnewaddress",          &getnewaddress,          true,      RPC_LOCK_ALL,    NULL },
+    { "getaccountaddress",      &getaccountaddress,      true,      RPC_LOCK_ALL,    NULL },
+    { "setaccount",             &setaccount,             true,      RPC_LOCK_ALL,    NULL },
+    { "getaccount",             &getaccount,             false,     RPC_LOCK_WALLET, NULL },
+    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,      RPC_LOCK_WALLET, NULL },
+    { "sendtoaddress",          &sendtoaddress,          false,     RPC_LOCK_ALL,    NULL },
+    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,     RPC_LOCK_ALL,    NULL },
+    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,     RPC_LOCK_ALL,    NULL },
+    { "listminting",            NULL,                    false,     RPC_LOCK_NONE,   &listminting },
+    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,     RPC_LOCK_ALL,    NULL },
+    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,     RPC_LOCK_ALL,    NULL },
+    { "backupwallet",           &backupwallet,           true,      RPC_LOCK_NONE,   NULL },
+    { "getbackupinfo",          &getbackupinfo,          true,      RPC_LOCK_NONE,   NULL },
+    { "keypoolrefill",          &keypoolrefill,          true,      RPC_LOCK_ALL,    NULL },
+    { "walletpassphrase",       &walletpassphrase,       true,      RPC_LOCK_ALL,    NULL },
+    { "walletpassphrasechange", &walletpassphrasechange, false,     RPC_LOCK_ALL,    NULL },
+    { "walletlock",             &walletlock,             true,      RPC_LOCK_ALL,    NULL },
+    { "encryptwallet",          &encryptwallet,          false,     RPC_LOCK_ALL,    NULL },
+    { "validateaddress",        &validateaddress,        true,      RPC_LOCK_WALLET, NULL },
+    { "getbalance",             &getbalance,             false,     RPC_LOCK_ALL,    NULL },
+    { "move",                   &movecmd,                false,     RPC_LOCK_ALL,    NULL },
+    { "sendfrom",               &sendfrom,               false,     RPC_LOCK_ALL,    NULL },
+    { "sendmany",               &sendmany,               false,     RPC_LOCK_ALL,    NULL },
+    { "addmultisigaddress",     &addmultisigaddress,     false,     RPC_LOCK_ALL,    NULL },
+    { "createmultisig",         &createmultisig,         true,      RPC_LOCK_NONE,   NULL },
+    { "getrawmempool",          NULL,                    true,      RPC_LOCK_NONE,   &getrawmempool },
+    { "getblock",               NULL,                    false,     RPC_LOCK_NONE,   &getblock },
+    { "getblockheaders",        NULL,                    false,     RPC_LOCK_NONE,   &getblockheaders },
+    { "getblocks",              NULL,                    false,     RPC_LOCK_NONE,   &getblocks },
+    { "getblockhash",           &getblockhash,           false,     RPC_LOCK_MAIN,   NULL },
+    { "getbestblockhash",       &getbestblockhash,       false,     RPC_LOCK_NONE,   NULL },
+    { "gettransaction",         &gettransaction,         false,     RPC_LOCK_ALL,    NULL },
+    { "estimatefee",            &estimatefee,            true,      RPC_LOCK_NONE,   NULL },
+    { "listtransactions",       &listtransactions,       false,     RPC_LOCK_ALL,    NULL },
+    { "listaddressgroupings",   &listaddressgroupings,   false,     RPC_LOCK_ALL,    NULL },
+    { "signmessage",            &signmessage,            false,     RPC_LOCK_ALL,    NULL },
+    { "verifymessage",          &verifymessage,          false,     RPC_LOCK_ALL,    NULL },
 #ifndef DISABLE_MINING
-    { "getwork",                &getwork,                true,      false },
+    { "getwork",                &getwork,                true,      RPC_LOCK_ALL,    NULL },
 #endif // DISABLE_MINING
-    { "listaccounts",           &listaccounts,           false,     false },
-    { "settxfee",               &settxfee,               false,     false },
+    { "listaccounts",           &listaccounts,           false,     RPC_LOCK_ALL,    NULL },
+    { "settxfee",               &settxfee,               false,     RPC_LOCK_WALLET, NULL },
 #ifndef DISABLE_MINING
-    { "getblocktemplate",       &getblocktemplate,       true,      false },
+    { "getblocktemplate",       &getblocktemplate,       true,      RPC_LOCK_ALL,    NULL },
 #endif // DISABLE_MINING
-    { "submitblock",            &submitblock,            false,     false },
-    { "listsinceblock",         &listsinceblock,         false,     false },
-    { "dumpprivkey",            &dumpprivkey,            true,      false },
-    { "importprivkey",          &importprivkey,          false,     false },
-    { "getcheckpoint",          &getcheckpoint,          true,      false },
-    { "sendcheckpoint",         &sendcheckpoint,         true,      false },
-    { "enforcecheckpoint",      &enforcecheckpoint,      true,      false },
-    { "reservebalance",         &reservebalance,         false,     false },
-    { "checkwallet",            &checkwallet,            false,     false },
-    { "repairwallet",           &repairwallet,           false,     false },
-    { "makekeypair",            &makekeypair,            false,     false },
-    { "showkeypair",            &showkeypair,            false,     false },
-    { "sendalert",              &sendalert,              false,     false },
-    { "listunspent",            &listunspent,            false,     false },
-    { "getrawtransaction",      &getrawtransaction,      false,     false },
-    { "createrawtransaction",   &createrawtransaction,   false,     false },
-    { "decoderawtransaction",   &decoderawtransaction,   false,     false },
-    { "signrawtransaction",     &signrawtransaction,     false,     false },
-    { "sendrawtransaction",     &sendrawtransaction,     false,     false },
-    { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false },
-    { "gettxout",               &gettxout,               true,      false },
-    { "lockunspent",            &lockunspent,            false,     false },
-    { "listlockunspent",        &listlockunspent,        false,     false },
-    { "getbestblockhash",       &getbestblockhash,       false,     false },
-    { "removetransaction",      &removetransaction,      false,     false },
+    { "submitblock",            &submitblock,            false,     RPC_LOCK_ALL,    NULL },
+    { "listsinceblock",         &listsinceblock,         false,     RPC_LOCK_ALL,    NULL },
+    { "dumpprivkey",            &dumpprivkey,            true,      RPC_LOCK_ALL,    NULL },
+    { "importprivkey",          &importprivkey,          false,     RPC_LOCK_NONE,   NULL },
+    { "getrescaninfo",          &getrescaninfo,          true,      RPC_LOCK_NONE,   NULL },
+    { "abortrescan",            &abortrescan,            true,      RPC_LOCK_NONE,   NULL },
+    { "getcheckpoint",          &getcheckpoint,          true,      RPC_LOCK_MAIN,   NULL },
+    { "sendcheckpoint",         &sendcheckpoint,         true,      RPC_LOCK_ALL,    NULL },
+    { "enforcecheckpoint",      &enforcecheckpoint,      true,      RPC_LOCK_ALL,    NULL },
+    { "reservebalance",         &reservebalance,         false,     RPC_LOCK_ALL,    NULL },
+    { "checkwallet",            &checkwallet,            false,     RPC_LOCK_ALL,    NULL },
+    { "repairwallet",           &repairwallet,           false,     RPC_LOCK_ALL,    NULL },
+    { "makekeypair",            &makekeypair,            false,     RPC_LOCK_ALL,    NULL },
+    { "showkeypair",            &showkeypair,            false,     RPC_LOCK_ALL,    NULL },
+    { "sendalert",              &sendalert,              false,     RPC_LOCK_ALL,    NULL },
+    { "listunspent",            &listunspent,            false,     RPC_LOCK_ALL,    NULL },
+    { "getrawtransaction",      &getrawtransaction,      false,     RPC_LOCK_MAIN,   NULL },
+    { "createrawtransaction",   &createrawtransaction,   false,     RPC_LOCK_NONE,   NULL },
+    { "decoderawtransaction",   &decoderawtransaction,   false,     RPC_LOCK_MAIN,   NULL },
+    { "signrawtransaction",     &signrawtransaction,     false,     RPC_LOCK_ALL,    NULL },
+    { "sendrawtransaction",     &sendrawtransaction,     false,     RPC_LOCK_ALL,    NULL },
+    { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      RPC_LOCK_MAIN,   NULL },
+    { "gettxout",               &gettxout,               true,      RPC_LOCK_MAIN,   NULL },
+    { "lockunspent",            &lockunspent,            false,     RPC_LOCK_WALLET, NULL },
+    { "listlockunspent",        &listlockunspent,        false,     RPC_LOCK_WALLET, NULL },
+    { "getbestblockhash",       &getbestblockhash,       false,     RPC_LOCK_NONE,   NULL },
+    { "removetransaction",      &removetransaction,      false,     RPC_LOCK_ALL,    NULL },
 #ifdef TESTING
-    { "generatestake",          &generatestake,          true,      false },
-    { "duplicateblock",         &duplicateblock,         true,      false },
-    { "ignorenextblock",        &ignorenextblock,        true,      false },
-    { "shutdown",               &shutdown,               true,      false },
-    { "timetravel",             &timetravel,             true,      false },
+    { "generatestake",          &generatestake,          true,      RPC_LOCK_ALL,    NULL },
+    { "duplicateblock",         &duplicateblock,         true,      RPC_LOCK_ALL,    NULL },
+    { "ignorenextblock",        &ignorenextblock,        true,      RPC_LOCK_ALL,    NULL },
+    { "shutdown",               &shutdown,               true,      RPC_LOCK_ALL,    NULL },
+    { "timetravel",             &timetravel,             true,      RPC_LOCK_ALL,    NULL },
 #endif
 };
 
@@ -574,11 +737,59 @@ bool ClientAllowed(const boost::asio::ip::address& address)
 class AcceptedConnection
 {
 public:
-    virtual ~AcceptedConnection() {}
+    AcceptedConnection(asio::io_service& io_service) :
+        bufIn(MAX_SIZE + RPC_MAX_HEADER_SIZE), timerRead(io_service), fReading(false), nProto(0), fCounted(false) {}
+    virtual ~AcceptedConnection()
+    {
+        if (fCounted)
+        {
+            boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+            nRPCConnections--;
+        }
+    }
+
+    // Counts the connection against -rpcmaxconnections, false if it is over
+    bool Admit()
+    {
+        boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+        if (nRPCConnections >= nRPCMaxConnections)
+            return false;
+        nRPCConnections++;
+        fCounted = true;
+        return true;
+    }
 
     virtual std::iostream& stream() = 0;
     virtual std::string peer_address_to_string() const = 0;
     virtual void close() = 0;
+    // Closes the socket, which aborts pending asynchronous I/O
+    virtual void close_socket() = 0;
+
+    // Asynchronous I/O, used while the connection waits for a request
+    virtual void async_handshake(boost::function<void(const boost::system::error_code&)> handler) = 0;
+    virtual void handshake_done() = 0;
+    virtual void async_read_until(const std::string& strDelim, boost::function<void(const boost::system::error_code&, size_t)> handler) = 0;
+    virtual void async_read(size_t nBytes, boost::function<void(const boost::system::error_code&, size_t)> handler) = 0;
+    virtual void async_write(const boost::shared_ptr<std::string>& pstrData, boost::function<void(const boost::system::error_code&, size_t)> handler) = 0;
+
+    // Data received but not parsed yet
+    asio::streambuf bufIn;
+
+    // Deadline of the request being read, see RPCReadRequest. Only used on
+    // the I/O thread.
+    deadline_timer timerRead;
+    bool fReading;
+
+    // The request being served. There is at most one per connection, and
+    // the body buffer is reused across keep-alive requests.
+    int nProto;
+    std::string strMethod;
+    std::string strURI;
+    std::map<std::string, std::string> mapHeaders;
+    std::string strRequest;
+
+private:
+    bool fCounted;
 };
 
 template <typename Protocol>
@@ -588,9 +799,11 @@ public:
     AcceptedConnectionImpl(
             asio::io_service& io_service,
             ssl::context &context,
-            bool fUseSSL) :
+            bool fUseSSLIn) :
+        AcceptedConnection(io_service),
         sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
+        fUseSSL(fUseSSLIn),
+        _d(sslStream, fUseSSLIn),
         _stream(_d)
     {
     }
@@ -610,22 +823,64 @@ public:
         _stream.close();
     }
 
+    virtual void close_socket()
+    {
+        boost::system::error_code ec;
+        sslStream.lowest_layer().close(ec);
+    }
+
+    virtual void async_handshake(boost::function<void(const boost::system::error_code&)> handler)
+    {
+        sslStream.async_handshake(ssl::stream_base::server, handler);
+    }
+
+    virtual void handshake_done()
+    {
+        _d.handshake_done();
+    }
+
+    virtual void async_read_until(const std::string& strDelim, boost::function<void(const boost::system::error_code&, size_t)> handler)
+    {
+        if (fUseSSL)
+            asio::async_read_until(sslStream, bufIn, strDelim, handler);
+        else
+            asio::async_read_until(sslStream.next_layer(), bufIn, strDelim, handler);
+    }
+
+    virtual void async_read(size_t nBytes, boost::function<void(const boost::system::error_code&, size_t)> handler)
+    {
+        if (fUseSSL)
+            asio::async_read(sslStream, bufIn, asio::transfer_exactly(nBytes), handler);
+        else
+            asio::async_read(sslStream.next_layer(), bufIn, asio::transfer_exactly(nBytes), handler);
+    }
+
+    virtual void async_write(const boost::shared_ptr<std::string>& pstrData, boost::function<void(const boost::system::error_code&, size_t)> handler)
+    {
+        if (fUseSSL)
+            asio::async_write(sslStream, asio::buffer(*pstrData), handler);
+        else
+            asio::async_write(sslStream.next_layer(), asio::buffer(*pstrData), handler);
+    }
+
     typename Protocol::endpoint peer;
     asio::ssl::stream<typename Protocol::socket> sslStream;
 
 private:
+    bool fUseSSL;
     SSLIOStreamDevice<Protocol> _d;
     iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
 };
 
-void ServiceConnection(AcceptedConnection *conn);
+static bool ServiceRequest(AcceptedConnection *conn);
+static void RunRPCBatch(const boost::shared_ptr<CRPCBatch>& batch);
 
 // Forward declaration required for RPCListen
 template <typename SocketAcceptor>
 static void RPCAcceptHandler(boost::shared_ptr<SocketAcceptor> acceptor,
                              ssl::context& context,
                              bool fUseSSL,
-                             AcceptedConnection* conn,
+                             boost::shared_ptr<AcceptedConnection> conn,
                              const boost::system::error_code& error);
 
 /**
@@ -637,7 +892,8 @@ static void RPCListen(boost::shared_ptr<SocketAcceptor> acceptor,
                    const bool fUseSSL)
 {
     // Accept connection
-    AcceptedConnectionImpl<typename SocketAcceptor::protocol_type>* conn = new AcceptedConnectionImpl<typename SocketAcceptor::protocol_type>((((boost::asio::io_context&)(acceptor)).get_executor().context()), context, fUseSSL);
+    boost::shared_ptr<AcceptedConnectionImpl<typename SocketAcceptor::protocol_type> > conn(
+            new AcceptedConnectionImpl<typename SocketAcceptor::protocol_type>(*rpc_io_service, context, fUseSSL));
 
     acceptor->async_accept(
             conn->sslStream.lowest_layer(),
@@ -646,10 +902,124 @@ static void RPCListen(boost::shared_ptr<SocketAcceptor> acceptor,
                 acceptor,
                 boost::ref(context),
                 fUseSSL,
-                conn,
+                boost::shared_ptr<AcceptedConnection>(conn),
                 boost::asio::placeholders::error));
 }
 
+// Nothing to do once a final reply is sent: the connection is closed when
+// the last handler that refers to it is gone.
+static void RPCWriteHandler(boost::shared_ptr<AcceptedConnection> conn, boost::shared_ptr<std::string> pstrReply)
+{
+}
+
+// Send an empty reply with the given status without blocking the I/O thread, then close
+static void RPCReplyAndClose(boost::shared_ptr<AcceptedConnection> conn, int nStatus)
+{
+    boost::shared_ptr<std::string> pstrReply(new std::string(HTTPReply(nStatus, "", false)));
+    conn->async_write(pstrReply, boost::bind(&RPCWriteHandler, conn, pstrReply));
+}
+
+/**
+ * Hand the request read into conn to the RPC workers, or refuse it with
+ * 503 Service Unavailable when -rpcworkqueue requests are already waiting.
+ */
+static void RPCBodyHandler(boost::shared_ptr<AcceptedConnection> conn, size_t nLen, const boost::system::error_code& error)
+{
+    if (error)
+        return;
+
+    // The request is complete, its deadline no longer applies
+    conn->fReading = false;
+    conn->timerRead.cancel();
+
+    conn->strRequest.resize(nLen);
+    if (nLen > 0)
+    {
+        asio::buffer_copy(asio::buffer(&conn->strRequest[0], nLen), conn->bufIn.data());
+        conn->bufIn.consume(nLen);
+    }
+
+    string& strConnection = conn->mapHeaders["connection"];
+    if (strConnection != "close" && strConnection != "keep-alive")
+        strConnection = conn->nProto >= 1 ? "keep-alive" : "close";
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutexRPCWork);
+        if (dequeRPCWork.size() < nRPCWorkQueueDepth)
+        {
+            dequeRPCWork.push_back(conn);
+            condRPCWork.notify_one();
+            return;
+        }
+    }
+    printf("ThreadRPCServer work queue is full, refusing request from %s\n", conn->peer_address_to_string().c_str());
+    RPCReplyAndClose(conn, HTTP_SERVICE_UNAVAILABLE);
+}
+
+static void RPCHeaderHandler(boost::shared_ptr<AcceptedConnection> conn, const boost::system::error_code& error)
+{
+    // Closed by the client, or headers that do not fit in the input buffer
+    if (error)
+        return;
+
+    std::istream stream(&conn->bufIn);
+    conn->mapHeaders.clear();
+    if (!ReadHTTPRequestLine(stream, conn->nProto, conn->strMethod, conn->strURI))
+        return;
+    int nLen = ReadHTTPHeaders(stream, conn->mapHeaders);
+    if (nLen < 0 || nLen > (int)MAX_SIZE || boost::iequals(conn->mapHeaders["transfer-encoding"], "chunked"))
+    {
+        RPCReplyAndClose(conn, HTTP_BAD_REQUEST);
+        return;
+    }
+
+    if (conn->bufIn.size() < (size_t)nLen)
+        conn->async_read(nLen - conn->bufIn.size(),
+                boost::bind(&RPCBodyHandler, conn, (size_t)nLen, boost::asio::placeholders::error));
+    else
+        RPCBodyHandler(conn, nLen, boost::system::error_code());
+}
+
+// Close a connection that did not send a complete request in time. The
+// timer does not keep the connection alive.
+static void RPCReadTimeoutHandler(boost::weak_ptr<AcceptedConnection> wconn, const boost::system::error_code& error)
+{
+    if (error == asio::error::operation_aborted)
+        return;
+    boost::shared_ptr<AcceptedConnection> conn = wconn.lock();
+    if (conn && conn->fReading)
+        conn->close_socket();
+}
+
+// Give the connection -rpcreadtimeout seconds for its next request, from
+// the handshake or the end of the previous request on
+static void RPCStartReadDeadline(boost::shared_ptr<AcceptedConnection> conn)
+{
+    conn->fReading = true;
+    conn->timerRead.expires_from_now(posix_time::seconds(nRPCReadTimeout));
+    conn->timerRead.async_wait(boost::bind(&RPCReadTimeoutHandler,
+            boost::weak_ptr<AcceptedConnection>(conn), boost::asio::placeholders::error));
+}
+
+/**
+ * Wait for the next request on a connection. Idle keep-alive connections
+ * only have a read pending, they do not hold a thread.
+ */
+static void RPCReadRequest(boost::shared_ptr<AcceptedConnection> conn)
+{
+    RPCStartReadDeadline(conn);
+    conn->async_read_until("\r\n\r\n",
+            boost::bind(&RPCHeaderHandler, conn, boost::asio::placeholders::error));
+}
+
+static void RPCHandshakeHandler(boost::shared_ptr<AcceptedConnection> conn, const boost::system::error_code& error)
+{
+    if (error)
+        return;
+
+    conn->handshake_done();
+    RPCReadRequest(conn);
+}
 
 /**
  * Accept and handle incoming connection.
@@ -658,35 +1028,83 @@ template <typename SocketAcceptor>
 static void RPCAcceptHandler(boost::shared_ptr<SocketAcceptor> acceptor,
                              ssl::context& context,
                              const bool fUseSSL,
-                             AcceptedConnection* conn,
+                             boost::shared_ptr<AcceptedConnection> conn,
                              const boost::system::error_code& error)
 {
     // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
     if (error != asio::error::operation_aborted && acceptor->is_open())
         RPCListen(acceptor, context, fUseSSL);
 
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn);
+    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn.get());
 
     // TODO: Actually handle errors
     if (error)
-    {
-        delete conn;
-    }
+        return;
 
     // Restrict callers by IP.  It is important to
     // do this before starting client thread, to filter out
     // certain DoS and misbehaving clients.
-    else if (tcp_conn && !ClientAllowed(tcp_conn->peer.address()))
+    if (tcp_conn && !ClientAllowed(tcp_conn->peer.address()))
     {
         // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
         if (!fUseSSL)
-            conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
-        delete conn;
+            RPCReplyAndClose(conn, HTTP_FORBIDDEN);
+        return;
+    }
+
+    if (!conn->Admit())
+    {
+        printf("ThreadRPCServer too many connections, refusing %s\n", conn->peer_address_to_string().c_str());
+        if (!fUseSSL)
+            RPCReplyAndClose(conn, HTTP_SERVICE_UNAVAILABLE);
+        return;
+    }
+
+    if (fUseSSL)
+    {
+        RPCStartReadDeadline(conn);
+        conn->async_handshake(boost::bind(&RPCHandshakeHandler, conn, boost::asio::placeholders::error));
     }
-    else {
-        ServiceConnection(conn);
-        conn->close();
-        delete conn;
+    else
+        RPCReadRequest(conn);
+}
+
+/**
+ * Run the requests that the I/O thread has read completely, and give
+ * keep-alive connections back to it to wait for their next request.
+ * Requests of batches that are already being served come first.
+ */
+static void ThreadRPCWorker()
+{
+    RenameThread("peercoin-rpcwork");
+
+    while (true)
+    {
+        boost::shared_ptr<AcceptedConnection> conn;
+        boost::shared_ptr<CRPCBatch> batch;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexRPCWork);
+            while (dequeRPCWork.empty() && dequeRPCBatches.empty())
+                condRPCWork.wait(lock);
+            if (!dequeRPCBatches.empty())
+                batch = dequeRPCBatches.front();
+            else
+            {
+                conn = dequeRPCWork.front();
+                dequeRPCWork.pop_front();
+            }
+        }
+
+        boost::this_thread::disable_interruption di;
+        if (batch)
+        {
+            RunRPCBatch(batch);
+            continue;
+        }
+        if (ServiceRequest(conn.get()))
+            rpc_io_service->post(boost::bind(&RPCReadRequest, conn));
+        else
+            conn->close();
     }
 }
 
@@ -807,9 +1225,15 @@ void StartRPCThreads()
         return;
     }
 
+    nRPCWorkQueueDepth = std::max((int)GetArg("-rpcworkqueue", 16), 1);
+    nRPCMaxConnections = std::max((int)GetArg("-rpcmaxconnections", 64), 1);
+    nRPCReadTimeout = std::max((int)GetArg("-rpcreadtimeout", 30), 1);
+
+    // One thread accepts connections and reads requests, the workers run them
     rpc_worker_group = new boost::thread_group();
+    rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
     for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
-        rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
+        rpc_worker_group->create_thread(&ThreadRPCWorker);
 }
 
 void StopRPCThreads()
@@ -820,8 +1244,14 @@ void StopRPCThreads()
 
     deadlineTimers.clear();
     rpc_io_service->stop();
+    rpc_worker_group->interrupt_all();
     rpc_worker_group->join_all();
     delete rpc_worker_group; rpc_worker_group = NULL;
+    {
+        boost::unique_lock<boost::mutex> lock(mutexRPCWork);
+        dequeRPCWork.clear();
+        dequeRPCBatches.clear();
+    }
     delete rpc_ssl_context; rpc_ssl_context = NULL;
     delete rpc_io_service; rpc_io_service = NULL;
 }
@@ -888,122 +1318,282 @@ void JSONRequest::parse(const Value& valRequest)
 }
 
 
-static Object JSONRPCExecOne(const Value& req)
+// Write the reply to a request, with its result written as it is produced
+static void JSONRPCWriteReply(CJSONWriter& writer, const JSONRequest& jreq)
 {
-    Object rpc_result;
+    writer.BeginObject();
+    writer.Key("result");
+    tableRPC.execute(jreq.strMethod, jreq.params, writer);
+    writer.Pair("error", Value::null);
+    writer.Pair("id", jreq.id);
+    writer.EndObject();
+}
 
+static string JSONRPCExecOne(const Value& req)
+{
     JSONRequest jreq;
     try {
         jreq.parse(req);
 
-        Value result = tableRPC.execute(jreq.strMethod, jreq.params);
-        rpc_result = JSONRPCReplyObj(result, Value::null, jreq.id);
+        ostringstream ss;
+        CJSONStreamWriter writer(ss);
+        JSONRPCWriteReply(writer, jreq);
+        return ss.str();
     }
     catch (Object& objError)
     {
-        rpc_result = JSONRPCReplyObj(Value::null, objError, jreq.id);
+        return write_string(Value(JSONRPCReplyObj(Value::null, objError, jreq.id)), false);
     }
     catch (std::exception& e)
     {
-        rpc_result = JSONRPCReplyObj(Value::null,
-                                     JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        return write_string(Value(JSONRPCReplyObj(Value::null,
+                                                  JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id)), false);
     }
-
-    return rpc_result;
 }
 
-static string JSONRPCExecBatch(const Array& vReq)
+/**
+ * The requests of a JSON-RPC batch, run by the RPC worker serving the
+ * connection and by idle workers. Each reply is serialized by the thread that
+ * ran its request; Wait() joins them in request order. The batch owns its
+ * requests, helpers may still hold it after the connection is done.
+ */
+class CRPCBatch
 {
-    Array ret;
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+private:
+    const Array vReq;
+    std::vector<std::string> vReply;
+    unsigned int nNext;
+    unsigned int nDone;
+    boost::mutex mutex;
+    boost::condition_variable condDone;
 
-    return write_string(Value(ret), false) + "\n";
-}
+public:
+    CRPCBatch(const Array& vReqIn) : vReq(vReqIn), vReply(vReqIn.size()), nNext(0), nDone(0) {}
 
-void ServiceConnection(AcceptedConnection *conn)
-{
-    bool fRun = true;
-    while (fRun)
+    // Run the next request that nobody has started yet, false if there is none
+    bool RunNext()
     {
-        int nProto = 0;
-        map<string, string> mapHeaders;
-        string strRequest, strMethod, strURI;
-
-        // Read HTTP request line
-        if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
-
-        // Read HTTP message headers and body
-        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto);
-
-        if (strURI != "/") {
-            conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
-            break;
+        unsigned int nIdx;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (nNext >= vReq.size())
+                return false;
+            nIdx = nNext++;
         }
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
+        string strReply = JSONRPCExecOne(vReq[nIdx]);
+
         {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            boost::unique_lock<boost::mutex> lock(mutex);
+            vReply[nIdx].swap(strReply);
+            if (++nDone == vReq.size())
+                condDone.notify_all();
         }
-        if (!HTTPAuthorized(mapHeaders))
+        return true;
+    }
+
+    // Wait for the requests still running on other threads
+    string Wait()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (nDone < vReq.size())
+            condDone.wait(lock);
+
+        size_t nSize = 3;
+        BOOST_FOREACH(const string& strReply, vReply)
+            nSize += strReply.size() + 1;
+        string strRet;
+        strRet.reserve(nSize);
+        strRet += "[";
+        for (unsigned int i = 0; i < vReply.size(); i++)
         {
-            printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
-            /* Deter brute-forcing short passwords.
-               If this results in a DOS the user really
-               shouldn't have their RPC port exposed.*/
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
-
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            if (i > 0)
+                strRet += ",";
+            strRet += vReply[i];
         }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+        strRet += "]\n";
+        return strRet;
+    }
+};
 
-        JSONRequest jreq;
-        try
-        {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+static void RemoveRPCBatch(const boost::shared_ptr<CRPCBatch>& batch)
+{
+    boost::unique_lock<boost::mutex> lock(mutexRPCWork);
+    std::deque<boost::shared_ptr<CRPCBatch> >::iterator it = std::find(dequeRPCBatches.begin(), dequeRPCBatches.end(), batch);
+    if (it != dequeRPCBatches.end())
+        dequeRPCBatches.erase(it);
+}
+
+// Run requests of the batch until none is left to start. A request that was
+// started must complete, or its batch never returns, so the caller disables
+// interruption.
+static void RunRPCBatch(const boost::shared_ptr<CRPCBatch>& batch)
+{
+    while (batch->RunNext());
+    RemoveRPCBatch(batch);
+}
 
-            string strReply;
+static string JSONRPCExecBatch(const Array& vReq)
+{
+    boost::shared_ptr<CRPCBatch> batch(new CRPCBatch(vReq));
+    if (vReq.size() > 1)
+    {
+        boost::unique_lock<boost::mutex> lock(mutexRPCWork);
+        dequeRPCBatches.push_back(batch);
+        condRPCWork.notify_all();
+    }
 
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
+    // Work on our own batch too, so that it completes even when all other
+    // workers are busy
+    RunRPCBatch(batch);
+    return batch->Wait();
+}
 
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+// Run the request read into conn and send its reply. Returns whether the
+// connection stays open for another request.
+static bool ServiceRequest(AcceptedConnection *conn)
+{
+    const string& strRequest = conn->strRequest;
+    map<string, string>& mapHeaders = conn->mapHeaders;
+    const int nProto = conn->nProto;
+    bool fRun = mapHeaders["connection"] != "close";
 
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
+    // The REST interface is read-only and needs no authorization
+    if (GetBoolArg("-rest") && boost::starts_with(conn->strURI, "/rest/"))
+        return HTTPReq_REST(conn->stream(), conn->strMethod, conn->strURI, nProto, fRun);
 
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+    if (conn->strURI != "/") {
+        conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
+        return false;
+    }
 
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
-        }
-        catch (Object& objError)
-        {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
-        }
-        catch (std::exception& e)
-        {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
-        }
+    // Check authorization
+    if (mapHeaders.count("authorization") == 0)
+    {
+        conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
+        return false;
+    }
+    if (!HTTPAuthorized(mapHeaders))
+    {
+        printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
+        /* Deter brute-forcing short passwords.
+           If this results in a DOS the user really
+           shouldn't have their RPC port exposed.*/
+        if (mapArgs["-rpcpassword"].size() < 20)
+            MilliSleep(250);
+
+        conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
+        return false;
+    }
+
+    JSONRequest jreq;
+    try
+    {
+        // Parse request
+        Value valRequest;
+        if (!ReadJSON(strRequest, valRequest))
+            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+
+        string strReply;
+
+        // singleton request
+        if (valRequest.type() == obj_type) {
+            jreq.parse(valRequest);
+
+            if (nProto >= 1)
+            {
+                // Send the reply in chunks while the result is produced
+                CHTTPChunkedStreamBuf buf(conn->stream(), HTTPReplyChunkedHeader(HTTP_OK, fRun));
+                std::ostream os(&buf);
+                CJSONStreamWriter writer(os);
+                try
+                {
+                    JSONRPCWriteReply(writer, jreq);
+                    os << "\n";
+                }
+                catch (...)
+                {
+                    if (!buf.Started())
+                        throw;
+                    // Part of the result was sent, the client sees the reply cut short
+                    printf("ThreadRPCServer %s failed while sending its reply\n", jreq.strMethod.c_str());
+                    return false;
+                }
+                if (!buf.Finish())
+                    return false;
+                return fRun;
+            }
+
+            ostringstream ss;
+            CJSONStreamWriter writer(ss);
+            JSONRPCWriteReply(writer, jreq);
+            ss << "\n";
+            strReply = ss.str();
+
+        // array of requests
+        } else if (valRequest.type() == array_type)
+            strReply = JSONRPCExecBatch(valRequest.get_array());
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+
+        conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
     }
+    catch (Object& objError)
+    {
+        ErrorReply(conn->stream(), objError, jreq.id);
+        return false;
+    }
+    catch (std::exception& e)
+    {
+        ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        return false;
+    }
+
+    return fRun && conn->stream().good();
 }
 
 json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+{
+    Value result;
+    execute(strMethod, params, &result, NULL);
+    return result;
+}
+
+void CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params, CJSONWriter& writer) const
+{
+    Value result;
+    execute(strMethod, params, &result, &writer);
+}
+
+// Add a call to the statistics of its method, and log it if it took longer than -rpcslowcall
+static void RecordRPCCall(const string& strMethod, const Array& params, int64 nWait, int64 nExec, bool fError)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexRPCStats);
+        mapRPCStats[strMethod].Add(nWait, nExec, fError);
+    }
+
+    int64 nSlowCall = GetArg("-rpcslowcall", 0);
+    if (nSlowCall > 0 && nWait + nExec >= nSlowCall * 1000)
+        printf("ThreadRPCServer slow call: method=%s params=%" PRIszu" bytes lockwait=%.2fms exec=%.2fms%s\n",
+               strMethod.c_str(), write_string(Value(params), false).size(),
+               nWait / 1000.0, nExec / 1000.0, fError ? " (error)" : "");
+}
+
+// nLocked is set to the time the locks of the command were acquired
+static void RunCommand(const CRPCCommand* pcmd, const Array& params, Value* pResult, CJSONWriter& writer, int64& nLocked)
+{
+    nLocked = GetTimeMicros();
+    if (pcmd->actor)
+        *pResult = pcmd->actor(params, false);
+    else
+        pcmd->streamer(params, false, writer);
+}
+
+// Run a command with the locks it declares. The result is written to
+// *pWriter if the command streams it, and stored in *pResult otherwise;
+// results that are not streamed are written after the locks are released.
+void CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params, Value* pResult, CJSONWriter* pWriter) const
 {
     // Find method
     const CRPCCommand *pcmd = tableRPC[strMethod];
@@ -1016,24 +1606,55 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
 
+    int64 nStart = GetTimeMicros();
+    int64 nLocked = nStart;
     try
     {
         // Execute
-        Value result;
+        CJSONValueWriter valueWriter;
+        CJSONWriter& writer = pWriter ? *pWriter : valueWriter;
         {
-            if (pcmd->threadSafe)
-                result = pcmd->actor(params, false);
-            else {
+            switch (pcmd->nLocks)
+            {
+            case RPC_LOCK_NONE:
+                RunCommand(pcmd, params, pResult, writer, nLocked);
+                break;
+            case RPC_LOCK_MAIN:
+            {
+                LOCK(cs_main);
+                RunCommand(pcmd, params, pResult, writer, nLocked);
+                break;
+            }
+            case RPC_LOCK_WALLET:
+            {
+                LOCK(pwalletMain->cs_wallet);
+                RunCommand(pcmd, params, pResult, writer, nLocked);
+                break;
+            }
+            default:
+            {
                 LOCK2(cs_main, pwalletMain->cs_wallet);
-                result = pcmd->actor(params, false);
+                RunCommand(pcmd, params, pResult, writer, nLocked);
+                break;
+            }
             }
         }
-        return result;
+        if (pcmd->actor && pWriter)
+            pWriter->WriteValue(*pResult);
+        else if (!pcmd->actor && !pWriter)
+            *pResult = valueWriter.GetValue();
     }
     catch (std::exception& e)
     {
+        RecordRPCCall(strMethod, params, nLocked - nStart, GetTimeMicros() - nLocked, true);
         throw JSONRPCError(RPC_MISC_ERROR, e.what());
     }
+    catch (...)
+    {
+        RecordRPCCall(strMethod, params, nLocked - nStart, GetTimeMicros() - nLocked, true);
+        throw;
+    }
+    RecordRPCCall(strMethod, params, nLocked - nStart, GetTimeMicros() - nLocked, false);
 }
 
 const CRPCTable tableRPC;
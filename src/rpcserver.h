@@ -24,6 +24,10 @@ class CBlockIndex;
 void StartRPCThreads();
 void StopRPCThreads();
 
+// Serve a request to the read-only REST interface (-rest), in rest.cpp.
+// Returns whether the connection stays open for another request.
+bool HTTPReq_REST(std::iostream& stream, const std::string& strMethod, const std::string& strURI, int nProto, bool fKeepAlive);
+
 /*
   Type-check arguments; throws JSONRPCError if wrong type given. Does not check that
   the right number of arguments are passed, just that any passed are the correct type.
@@ -45,6 +49,17 @@ void RPCTypeCheck(const json_spirit::Object& o,
 void RPCRunLater(const std::string& name, boost::function<void(void)> func, int64 nSeconds);
 
 typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
+typedef void(*rpcstreamfn_type)(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
+
+// Locks CRPCTable::execute holds while a command runs. Commands that take
+// their own locks, or only read the chain tip, run with RPC_LOCK_NONE.
+enum RPCLocks
+{
+    RPC_LOCK_NONE   = 0,
+    RPC_LOCK_MAIN   = 1,    // cs_main
+    RPC_LOCK_WALLET = 2,    // pwalletMain->cs_wallet, must not take cs_main
+    RPC_LOCK_ALL    = 3     // cs_main, then pwalletMain->cs_wallet
+};
 
 class CRPCCommand
 {
@@ -52,7 +67,9 @@ public:
     std::string name;
     rpcfn_type actor;
     bool okSafeMode;
-    bool threadSafe;
+    int nLocks;
+    // Writes the result as it is produced, for commands without an actor
+    rpcstreamfn_type streamer;
 };
 
 /**
@@ -75,6 +92,17 @@ public:
      * @throws an exception (json_spirit::Value) when an error happens.
      */
     json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
+
+    /**
+     * Execute a method, writing its result to writer. Commands with a
+     * streamer write the result as they produce it.
+     * @throws an exception (json_spirit::Value) when an error happens, in
+     * which case part of the result may have been written already.
+     */
+    void execute(const std::string &method, const json_spirit::Array &params, CJSONWriter& writer) const;
+
+private:
+    void execute(const std::string &method, const json_spirit::Array &params, json_spirit::Value* pResult, CJSONWriter* pWriter) const;
 };
 
 extern const CRPCTable tableRPC;
@@ -100,6 +128,8 @@ extern json_spirit::Value sendcheckpoint(const json_spirit::Array& params, bool
 extern json_spirit::Value enforcecheckpoint(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value dumpprivkey(const json_spirit::Array& params, bool fHelp); // in rpcdump.cpp
 extern json_spirit::Value importprivkey(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getrescaninfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value abortrescan(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getgenerate(const json_spirit::Array& params, bool fHelp); // in rpcmining.cpp
 extern json_spirit::Value setgenerate(const json_spirit::Array& params, bool fHelp);
@@ -126,7 +156,7 @@ extern json_spirit::Value sendfrom(const json_spirit::Array& params, bool fHelp)
 extern json_spirit::Value sendmany(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value addmultisigaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value createmultisig(const json_spirit::Array& params, bool fHelp);
-extern json_spirit::Value listminting(const json_spirit::Array& params, bool fHelp);
+extern void listminting(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value listreceivedbyaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listreceivedbyaccount(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listtransactions(const json_spirit::Array& params, bool fHelp);
@@ -135,6 +165,7 @@ extern json_spirit::Value listaccounts(const json_spirit::Array& params, bool fH
 extern json_spirit::Value listsinceblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value backupwallet(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getbackupinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value keypoolrefill(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value walletpassphrase(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value walletpassphrasechange(const json_spirit::Array& params, bool fHelp);
@@ -155,11 +186,13 @@ extern json_spirit::Value sendrawtransaction(const json_spirit::Array& params, b
 extern json_spirit::Value getblockcount(const json_spirit::Array& params, bool fHelp); // in rpcblockchain.cpp
 extern json_spirit::Value getdifficulty(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp);
-extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
+extern void getrawmempool(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getbestblockhash(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value estimatefee(const json_spirit::Array& params, bool fHelp);
-extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
+extern void getblock(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
+extern void getblockheaders(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
+extern void getblocks(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value gettxoutsetinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxout(const json_spirit::Array& params, bool fHelp);
 
@@ -123,9 +123,6 @@ Value getnewaddress(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     // Generate a new key that is added to wallet
     CPubKey newKey;
     if (!pwalletMain->GetKeyFromPool(newKey, false))
@@ -509,7 +506,7 @@ int64 GetAccountBalance(CWalletDB& walletdb, const string& strAccount, int nMinD
     }
 
     // Tally internal accounting entries
-    nBalance += walletdb.GetAccountCreditDebit(strAccount);
+    nBalance += pwalletMain->GetAccountCreditDebit(strAccount);
 
     return nBalance;
 }
@@ -603,7 +600,6 @@ Value movecmd(const Array& params, bool fHelp)
     debit.nTime = nNow;
     debit.strOtherAccount = strTo;
     debit.strComment = strComment;
-    walletdb.WriteAccountingEntry(debit);
 
     // Credit
     CAccountingEntry credit;
@@ -613,11 +609,19 @@ Value movecmd(const Array& params, bool fHelp)
     credit.nTime = nNow;
     credit.strOtherAccount = strFrom;
     credit.strComment = strComment;
-    walletdb.WriteAccountingEntry(credit);
 
+    if (!walletdb.WriteAccountingEntry(debit) || !walletdb.WriteAccountingEntry(credit))
+    {
+        walletdb.TxnAbort();
+        throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
+    }
     if (!walletdb.TxnCommit())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
+    // Only show the move in the activity log once it is on disk
+    pwalletMain->AddAccountingEntry(debit);
+    pwalletMain->AddAccountingEntry(credit);
+
     return true;
 }
 
@@ -1088,11 +1092,10 @@ Value listtransactions(const Array& params, bool fHelp)
 
     Array ret;
 
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
+    const CWallet::TxItems& txOrdered = pwalletMain->OrderedTxItems();
 
     // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
     {
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
@@ -1160,9 +1163,7 @@ Value listaccounts(const Array& params, bool fHelp)
         }
     }
 
-    list<CAccountingEntry> acentries;
-    CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit("*", acentries);
-    BOOST_FOREACH(const CAccountingEntry& entry, acentries)
+    BOOST_FOREACH(const CAccountingEntry& entry, pwalletMain->laccentries)
         mapAccountBalances[entry.strAccount] += entry.nCreditDebit;
 
     Object ret;
@@ -1202,12 +1203,24 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    if (depth == -1)
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions);
+        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+            ListTransactions((*it).second, "*", 0, true, transactions);
+    }
+    else
+    {
+        // Only transactions filed as unconfirmed or above the given block can
+        // qualify; seek to those instead of walking the whole wallet
+        typedef multimap<int, CWalletTx*>::const_iterator height_iterator;
+        const multimap<int, CWalletTx*>& mapTxByHeight = pwalletMain->mapTxByHeight;
+        pair<height_iterator, height_iterator> unconfirmed = mapTxByHeight.equal_range(-1);
+        for (height_iterator it = unconfirmed.first; it != unconfirmed.second; ++it)
+            if ((*it).second->GetDepthInMainChain() < depth)
+                ListTransactions(*(*it).second, "*", 0, true, transactions);
+        for (height_iterator it = mapTxByHeight.upper_bound(pindex->nHeight); it != mapTxByHeight.end(); ++it)
+            if ((*it).second->GetDepthInMainChain() < depth)
+                ListTransactions(*(*it).second, "*", 0, true, transactions);
     }
 
     uint256 lastblock;
@@ -1274,7 +1287,8 @@ Value backupwallet(const Array& params, bool fHelp)
     if (fHelp || params.size() != 1)
         throw runtime_error(
             "backupwallet <destination>\n"
-            "Safely copies wallet.dat to destination, which can be a directory or a path with filename.");
+            "Safely copies wallet.dat to destination, which can be a directory or a path with filename.\n"
+            "The wallet stays usable while it is copied, see getbackupinfo.");
 
     string strDest = params[0].get_str();
     if (!BackupWallet(*pwalletMain, strDest))
@@ -1283,6 +1297,28 @@ Value backupwallet(const Array& params, bool fHelp)
     return Value::null;
 }
 
+Value getbackupinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getbackupinfo\n"
+            "Returns the progress of the running wallet backup, if any.");
+
+    Object obj;
+    obj.push_back(Pair("backingup",    (bool)pwalletMain->fBackingUp));
+    if (pwalletMain->fBackingUp)
+    {
+        int nRecords = pwalletMain->nBackupRecords;
+        int nRecordsTotal = pwalletMain->nBackupRecordsTotal;
+        obj.push_back(Pair("records",      nRecords));
+        obj.push_back(Pair("bytes",        (boost::int64_t)pwalletMain->nBackupBytes));
+        if (nRecordsTotal > 0)
+            obj.push_back(Pair("progress",     std::min(1.0, (double)nRecords / nRecordsTotal)));
+        obj.push_back(Pair("duration",     (boost::int64_t)(GetTime() - pwalletMain->nBackupStartTime)));
+    }
+    return obj;
+}
+
 
 Value keypoolrefill(const Array& params, bool fHelp)
 {
@@ -1302,14 +1338,6 @@ Value keypoolrefill(const Array& params, bool fHelp)
     return Value::null;
 }
 
-void ThreadTopUpKeyPool(void* parg)
-{
-    // Make this thread recognisable as the key-topping-up thread
-    RenameThread("peercoin-key-top");
-
-    pwalletMain->TopUpKeyPool();
-}
-
 void ThreadCleanWalletPassphrase(void* parg)
 {
     // Make this thread recognisable as the wallet relocking thread
@@ -1389,7 +1417,6 @@ Value walletpassphrase(const Array& params, bool fHelp)
             "walletpassphrase <passphrase> <timeout>\n"
             "Stores the wallet decryption key in memory for <timeout> seconds.");
 
-    NewThread(ThreadTopUpKeyPool, NULL);
     int64* pnSleepTime = new int64(params[1].get_int64());
     if (*pnSleepTime > 2147483647) *pnSleepTime = 2147483647;
     NewThread(ThreadCleanWalletPassphrase, pnSleepTime);
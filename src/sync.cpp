@@ -7,6 +7,107 @@
 
 #include <boost/foreach.hpp>
 
+#include <algorithm>
+
+bool fLockProfile = false;
+
+CLockSiteStats::CLockSiteStats(const char* pszNameIn, const char* pszFileIn, int nLineIn) :
+    pszName(pszNameIn), pszFile(pszFileIn), nLine(nLineIn),
+    nLocks(0), nWaitTotal(0), nWaitMax(0), nHoldTotal(0), nHoldMax(0)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        vWaitHistogram[i] = vHoldHistogram[i] = 0;
+}
+
+static int LockProfileBucket(int64 nMicros)
+{
+    int nBucket = 0;
+    for (int64 nLimit = 1; nMicros >= nLimit && nBucket < CLockSiteStats::HISTOGRAM_BUCKETS - 1; nLimit *= 10)
+        nBucket++;
+    return nBucket;
+}
+
+void CLockSiteStats::Add(int64 nWait, int64 nHold)
+{
+    nLocks++;
+    nWaitTotal += nWait;
+    nWaitMax = std::max(nWaitMax, nWait);
+    nHoldTotal += nHold;
+    nHoldMax = std::max(nHoldMax, nHold);
+    vWaitHistogram[LockProfileBucket(nWait)]++;
+    vHoldHistogram[LockProfileBucket(nHold)]++;
+}
+
+void CLockSiteStats::Add(const CLockSiteStats& stats)
+{
+    nLocks += stats.nLocks;
+    nWaitTotal += stats.nWaitTotal;
+    nWaitMax = std::max(nWaitMax, stats.nWaitMax);
+    nHoldTotal += stats.nHoldTotal;
+    nHoldMax = std::max(nHoldMax, stats.nHoldMax);
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        vWaitHistogram[i] += stats.vWaitHistogram[i];
+        vHoldHistogram[i] += stats.vHoldHistogram[i];
+    }
+}
+
+// Sites are recorded by the addresses of their name and file literals and
+// their line, the name because LOCK2 takes two locks on one line
+typedef std::pair<std::pair<const char*, const char*>, int> LockSite;
+
+static boost::mutex mutexLockProfile;
+static std::map<LockSite, CLockSiteStats> mapLockProfile;
+
+int64 GetLockProfileTime()
+{
+    return GetTimeMicros();
+}
+
+void RecordLockProfile(const char* pszName, const char* pszFile, int nLine, int64 nWait, int64 nHold)
+{
+    boost::unique_lock<boost::mutex> lock(mutexLockProfile);
+    LockSite site(std::make_pair(pszName, pszFile), nLine);
+    std::map<LockSite, CLockSiteStats>::iterator it = mapLockProfile.find(site);
+    if (it == mapLockProfile.end())
+        it = mapLockProfile.insert(std::make_pair(site, CLockSiteStats(pszName, pszFile, nLine))).first;
+    it->second.Add(nWait, nHold);
+}
+
+static bool CompareLockHoldTotal(const CLockSiteStats& a, const CLockSiteStats& b)
+{
+    return a.nHoldTotal > b.nHoldTotal;
+}
+
+void GetLockProfile(std::vector<CLockSiteStats>& vStats, bool fReset)
+{
+    std::map<LockSite, CLockSiteStats> mapProfile;
+    {
+        boost::unique_lock<boost::mutex> lock(mutexLockProfile);
+        mapProfile = mapLockProfile;
+        if (fReset)
+            mapLockProfile.clear();
+    }
+
+    // A site in a header is recorded once for each file that includes it
+    std::map<std::string, CLockSiteStats> mapSites;
+    for (std::map<LockSite, CLockSiteStats>::const_iterator it = mapProfile.begin(); it != mapProfile.end(); ++it)
+    {
+        const CLockSiteStats& stats = it->second;
+        std::string strSite = strprintf("%s %s:%d", stats.pszName, stats.pszFile, stats.nLine);
+        std::map<std::string, CLockSiteStats>::iterator mi = mapSites.find(strSite);
+        if (mi == mapSites.end())
+            mapSites.insert(std::make_pair(strSite, stats));
+        else
+            mi->second.Add(stats);
+    }
+
+    vStats.clear();
+    for (std::map<std::string, CLockSiteStats>::const_iterator it = mapSites.begin(); it != mapSites.end(); ++it)
+        vStats.push_back(it->second);
+    std::sort(vStats.begin(), vStats.end(), CompareLockHoldTotal);
+}
+
 #ifdef DEBUG_LOCKCONTENTION
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 {
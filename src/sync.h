@@ -10,6 +10,9 @@
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include "threadsafety.h"
+#include "uint256.h" // for int64
+
+#include <vector>
 
 // Template mixin that adds -Wthread-safety locking annotations to a
 // subset of the mutex API.
@@ -52,6 +55,41 @@ void static inline LeaveCritical() {}
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+/**
+ * Lock profiler, enabled with -lockprofile. Every LOCK, LOCK2 and
+ * successful TRY_LOCK site records how long it waited for its lock and
+ * how long it held it. Times are in microseconds. When disabled, a lock
+ * only tests fLockProfile.
+ */
+extern bool fLockProfile;
+
+class CLockSiteStats
+{
+public:
+    // Histogram buckets: < 1us, < 10us, < 100us, < 1ms, < 10ms, < 100ms, < 1s, more
+    static const int HISTOGRAM_BUCKETS = 8;
+
+    const char* pszName;
+    const char* pszFile;
+    int nLine;
+    int64 nLocks;
+    int64 nWaitTotal;
+    int64 nWaitMax;
+    int64 nHoldTotal;
+    int64 nHoldMax;
+    int64 vWaitHistogram[HISTOGRAM_BUCKETS];
+    int64 vHoldHistogram[HISTOGRAM_BUCKETS];
+
+    CLockSiteStats(const char* pszNameIn = "", const char* pszFileIn = "", int nLineIn = 0);
+    void Add(int64 nWait, int64 nHold);
+    void Add(const CLockSiteStats& stats);
+};
+
+int64 GetLockProfileTime();
+void RecordLockProfile(const char* pszName, const char* pszFile, int nLine, int64 nWait, int64 nHold);
+// Statistics of every lock site, sorted by total hold time, longest first
+void GetLockProfile(std::vector<CLockSiteStats>& vStats, bool fReset = false);
+
 /** Wrapper around boost::unique_lock<Mutex> */
 template<typename Mutex>
 class CMutexLock
@@ -59,9 +97,26 @@ class CMutexLock
 private:
     boost::unique_lock<Mutex> lock;
 
+    // Lock site and times, pszProfileName is only set when the lock is profiled
+    const char* pszProfileName;
+    const char* pszProfileFile;
+    int nProfileLine;
+    int64 nProfileWait;
+    int64 nProfileLocked;
+
+    void StartProfile(const char* pszName, const char* pszFile, int nLine, int64 nStart)
+    {
+        pszProfileName = pszName;
+        pszProfileFile = pszFile;
+        nProfileLine = nLine;
+        nProfileLocked = GetLockProfileTime();
+        nProfileWait = nProfileLocked - nStart;
+    }
+
     void Enter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
+        int64 nStart = fLockProfile ? GetLockProfileTime() : 0;
 #ifdef DEBUG_LOCKCONTENTION
         if (!lock.try_lock())
         {
@@ -71,19 +126,24 @@ private:
 #ifdef DEBUG_LOCKCONTENTION
         }
 #endif
+        if (nStart)
+            StartProfile(pszName, pszFile, nLine, nStart);
     }
 
     bool TryEnter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()), true);
+        int64 nStart = fLockProfile ? GetLockProfileTime() : 0;
         lock.try_lock();
         if (!lock.owns_lock())
             LeaveCritical();
+        else if (nStart)
+            StartProfile(pszName, pszFile, nLine, nStart);
         return lock.owns_lock();
     }
 
 public:
-    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : lock(mutexIn, boost::defer_lock)
+    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : lock(mutexIn, boost::defer_lock), pszProfileName(NULL)
     {
         if (fTry)
             TryEnter(pszName, pszFile, nLine);
@@ -94,7 +154,16 @@ public:
     ~CMutexLock()
     {
         if (lock.owns_lock())
+        {
+            if (pszProfileName)
+            {
+                // Recorded once the lock is released, so that it is not held any longer
+                int64 nHold = GetLockProfileTime() - nProfileLocked;
+                lock.unlock();
+                RecordLockProfile(pszProfileName, pszProfileFile, nProfileLine, nProfileWait, nHold);
+            }
             LeaveCritical();
+        }
     }
 
     operator bool()
@@ -0,0 +1,155 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockview.h"
+
+using namespace std;
+
+// A block with a coinbase, a coinstake and transactions with several
+// inputs and outputs, including scripts longer than 252 bytes
+static CBlock CreateTestBlock()
+{
+    CBlock block;
+    block.nVersion = 2;
+    block.hashPrevBlock = 1234;
+    block.nTime = 1400000000;
+    block.nBits = 0x1d00ffff;
+    block.nNonce = 42;
+
+    CTransaction txCoinBase;
+    txCoinBase.nTime = block.nTime;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vin[0].scriptSig = CScript() << 486604799 << CBigNum(4);
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].SetEmpty();
+    block.vtx.push_back(txCoinBase);
+
+    CTransaction txCoinStake;
+    txCoinStake.nTime = block.nTime;
+    txCoinStake.vin.push_back(CTxIn(COutPoint(5678, 1)));
+    txCoinStake.vout.push_back(CTxOut());
+    txCoinStake.vout[0].SetEmpty();
+    txCoinStake.vout.push_back(CTxOut(50 * COIN, CScript() << vector<unsigned char>(33, 2) << OP_CHECKSIG));
+    block.vtx.push_back(txCoinStake);
+
+    for (int i = 0; i < 3; i++)
+    {
+        CTransaction tx;
+        tx.nTime = block.nTime - i;
+        tx.nLockTime = i;
+        for (int j = 0; j <= i; j++)
+            tx.vin.push_back(CTxIn(COutPoint(1000 * i + j, j), CScript() << vector<unsigned char>(72 + 100 * j, j), j));
+        for (int j = 0; j < 3 - i; j++)
+            tx.vout.push_back(CTxOut(j * CENT, CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG));
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    block.vchBlockSig = vector<unsigned char>(71, 7);
+    return block;
+}
+
+static vector<unsigned char> SerializeBlock(const CBlock& block)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    return vector<unsigned char>(ss.begin(), ss.end());
+}
+
+// Whether the owning deserializer accepts vch as exactly one block
+static bool DeserializeBlock(const vector<unsigned char>& vch)
+{
+    CDataStream ss(vch, SER_DISK, CLIENT_VERSION);
+    CBlock block;
+    try {
+        ss >> block;
+    }
+    catch (std::exception &e) {
+        return false;
+    }
+    return ss.empty();
+}
+
+BOOST_AUTO_TEST_SUITE(blockview_tests)
+
+BOOST_AUTO_TEST_CASE(blockview_fields)
+{
+    CBlock block = CreateTestBlock();
+    vector<unsigned char> vch = SerializeBlock(block);
+    CBlockView view;
+    BOOST_CHECK(view.Parse(vch));
+    BOOST_CHECK(vch.empty());
+
+    BOOST_CHECK(view.header.GetHash() == block.GetHash());
+    BOOST_CHECK(vector<unsigned char>(view.vchBlockSig.begin(), view.vchBlockSig.end()) == block.vchBlockSig);
+    BOOST_CHECK_EQUAL(view.vtx.size(), block.vtx.size());
+    for (unsigned int i = 0; i < view.vtx.size(); i++)
+    {
+        const CTransaction& tx = block.vtx[i];
+        const CTransactionView& txview = view.vtx[i];
+        BOOST_CHECK(txview.GetHash() == tx.GetHash());
+        BOOST_CHECK_EQUAL(txview.nVersion, tx.nVersion);
+        BOOST_CHECK_EQUAL(txview.nTime, tx.nTime);
+        BOOST_CHECK_EQUAL(txview.nLockTime, tx.nLockTime);
+        BOOST_CHECK_EQUAL(txview.IsCoinBase(), tx.IsCoinBase());
+        BOOST_CHECK_EQUAL(txview.IsCoinStake(), tx.IsCoinStake());
+
+        BOOST_CHECK_EQUAL(txview.nIns, tx.vin.size());
+        for (unsigned int j = 0; j < txview.nIns; j++)
+        {
+            BOOST_CHECK(txview.pvin[j].GetPrevout() == tx.vin[j].prevout);
+            BOOST_CHECK(txview.pvin[j].scriptSig.ToScript() == tx.vin[j].scriptSig);
+            BOOST_CHECK_EQUAL(txview.pvin[j].nSequence, tx.vin[j].nSequence);
+        }
+        BOOST_CHECK_EQUAL(txview.nOuts, tx.vout.size());
+        for (unsigned int j = 0; j < txview.nOuts; j++)
+        {
+            BOOST_CHECK_EQUAL(txview.pvout[j].nValue, tx.vout[j].nValue);
+            BOOST_CHECK(txview.pvout[j].scriptPubKey.ToScript() == tx.vout[j].scriptPubKey);
+        }
+
+        CTransaction txCopy;
+        BOOST_CHECK(txview.GetTransaction(txCopy));
+        BOOST_CHECK(txCopy.GetHash() == tx.GetHash());
+    }
+
+    // a copy has its own views
+    CBlockView viewCopy = view;
+    view.SetNull();
+    BOOST_CHECK_EQUAL(viewCopy.vtx.size(), block.vtx.size());
+    BOOST_CHECK(viewCopy.vtx.back().GetHash() == block.vtx.back().GetHash());
+
+    CBlock blockCopy;
+    BOOST_CHECK(viewCopy.GetBlock(blockCopy));
+    BOOST_CHECK(SerializeBlock(blockCopy) == SerializeBlock(block));
+}
+
+BOOST_AUTO_TEST_CASE(blockview_differential)
+{
+    vector<unsigned char> vchBlock = SerializeBlock(CreateTestBlock());
+
+    // truncated blocks, and a block followed by more data, are refused like
+    // the owning deserializer refuses them
+    for (unsigned int n = 0; n <= vchBlock.size() + 1; n++)
+    {
+        vector<unsigned char> vch(vchBlock.begin(), vchBlock.begin() + min(n, (unsigned int)vchBlock.size()));
+        if (n > vchBlock.size())
+            vch.push_back(0);
+        bool fExpected = DeserializeBlock(vch);
+        CBlockView view;
+        BOOST_CHECK_EQUAL(view.Parse(vch), fExpected);
+    }
+
+    // corrupted bytes, mostly in sizes, give the same result as well
+    for (int i = 0; i < 2000; i++)
+    {
+        vector<unsigned char> vch = vchBlock;
+        vch[insecure_rand() % vch.size()] = insecure_rand();
+        if (i % 2)
+            vch[insecure_rand() % vch.size()] = 0xfd + insecure_rand() % 3;
+        bool fExpected = DeserializeBlock(vch);
+        CBlockView view;
+        BOOST_CHECK_EQUAL(view.Parse(vch), fExpected);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
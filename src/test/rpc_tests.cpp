@@ -1,5 +1,6 @@
 #include "rpcserver.h"
 #include "rpcclient.h"
+#include "main.h"
 
 #include "base58.h"
 
@@ -72,10 +73,13 @@ static Value CallRPC(string args)
     vArgs.erase(vArgs.begin());
     Array params = RPCConvertValues(strMethod, vArgs);
 
-    rpcfn_type method = tableRPC[strMethod]->actor;
+    const CRPCCommand* pcmd = tableRPC[strMethod];
     try {
-        Value result = (*method)(params, false);
-        return result;
+        if (pcmd->actor)
+            return (*pcmd->actor)(params, false);
+        CJSONValueWriter writer;
+        (*pcmd->streamer)(params, false, writer);
+        return writer.GetValue();
     }
     catch (Object& objError)
     {
@@ -153,4 +157,231 @@ BOOST_AUTO_TEST_CASE(rpc_rawsign)
     BOOST_CHECK(find_value(r.get_obj(), "complete").get_bool() == true);
 }
 
+static void WriteTestValue(CJSONWriter& writer)
+{
+    writer.BeginObject();
+    writer.Pair("str", "a \"quoted\"\n string");
+    writer.Key("empty");
+    writer.BeginArray();
+    writer.EndArray();
+    writer.Key("arr");
+    writer.BeginArray();
+    writer.WriteValue(1);
+    writer.BeginObject();
+    writer.Pair("x", 1.5);
+    writer.Pair("y", Value::null);
+    writer.EndObject();
+    writer.WriteValue(true);
+    writer.EndArray();
+    writer.Pair("n", (boost::int64_t)-7);
+    writer.EndObject();
+}
+
+BOOST_AUTO_TEST_CASE(rpc_blockrange)
+{
+    Value r;
+
+    BOOST_CHECK_THROW(CallRPC("getblockheaders 0"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("getblockheaders -1 1"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("getblockheaders 0 2001"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("getblocks 0 1 3"), runtime_error);
+
+    // the chain holds the genesis block only
+    BOOST_CHECK_NO_THROW(r=CallRPC("getblockheaders 0 10"));
+    BOOST_CHECK_EQUAL(r.get_array().size(), 1U);
+    BOOST_CHECK_EQUAL(find_value(r.get_array()[0].get_obj(), "height").get_int(), 0);
+    BOOST_CHECK_EQUAL(find_value(r.get_array()[0].get_obj(), "hash").get_str(), hashGenesisBlock.GetHex());
+
+    BOOST_CHECK_NO_THROW(r=CallRPC("getblocks 0 10"));
+    BOOST_CHECK_EQUAL(r.get_array().size(), 1U);
+    BOOST_CHECK_EQUAL(find_value(r.get_array()[0].get_obj(), "hash").get_str(), hashGenesisBlock.GetHex());
+
+    Value rHex;
+    BOOST_CHECK_NO_THROW(r=CallRPC("getblocks 0 1 0"));
+    BOOST_CHECK_NO_THROW(rHex=CallRPC(string("getblock ") + hashGenesisBlock.GetHex() + " false"));
+    BOOST_CHECK_EQUAL(r.get_array()[0].get_str(), rHex.get_str());
+}
+
+BOOST_AUTO_TEST_CASE(rpc_jsonwriter)
+{
+    Object inner;
+    inner.push_back(Pair("x", 1.5));
+    inner.push_back(Pair("y", Value::null));
+    Array arr;
+    arr.push_back(1);
+    arr.push_back(inner);
+    arr.push_back(true);
+    Object obj;
+    obj.push_back(Pair("str", "a \"quoted\"\n string"));
+    obj.push_back(Pair("empty", Array()));
+    obj.push_back(Pair("arr", arr));
+    obj.push_back(Pair("n", (boost::int64_t)-7));
+    string strExpected = write_string(Value(obj), false);
+
+    ostringstream ss;
+    CJSONStreamWriter streamWriter(ss);
+    WriteTestValue(streamWriter);
+    BOOST_CHECK_EQUAL(ss.str(), strExpected);
+
+    CJSONValueWriter valueWriter;
+    WriteTestValue(valueWriter);
+    BOOST_CHECK_EQUAL(write_string(valueWriter.GetValue(), false), strExpected);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_chunkedreply)
+{
+    string strBody;
+    for (int i = 0; i < 1000; i++)
+        strBody += strprintf("%d,", i);
+
+    // small chunks, so that the reply spans many of them
+    stringstream ss;
+    {
+        CHTTPChunkedStreamBuf buf(ss, HTTPReplyChunkedHeader(HTTP_OK, true), 100);
+        std::ostream os(&buf);
+        os << strBody.substr(0, 50);
+        BOOST_CHECK(!buf.Started());
+        os << strBody.substr(50);
+        BOOST_CHECK(buf.Started());
+        BOOST_CHECK(buf.Finish());
+    }
+
+    int nProto = 0;
+    BOOST_CHECK_EQUAL(ReadHTTPStatus(ss, nProto), HTTP_OK);
+    map<string, string> mapHeaders;
+    string strMessage;
+    BOOST_CHECK_EQUAL(ReadHTTPMessage(ss, mapHeaders, strMessage, nProto), HTTP_OK);
+    BOOST_CHECK_EQUAL(strMessage, strBody);
+}
+
+static int RESTStatus(const string& strURI, string& strBody)
+{
+    stringstream ss;
+    HTTPReq_REST(ss, "GET", strURI, 1, true);
+
+    int nProto = 0;
+    int nStatus = ReadHTTPStatus(ss, nProto);
+    map<string, string> mapHeaders;
+    ReadHTTPMessage(ss, mapHeaders, strBody, nProto);
+    return nStatus;
+}
+
+BOOST_AUTO_TEST_CASE(rpc_rest)
+{
+    string strHash = uint256(1).GetHex();
+    string strBody;
+    BOOST_CHECK_EQUAL(RESTStatus("/rest/block/" + strHash + ".bin", strBody), HTTP_NOT_FOUND);
+    BOOST_CHECK_EQUAL(RESTStatus("/rest/block/" + strHash + ".xml", strBody), HTTP_NOT_FOUND);
+    BOOST_CHECK_EQUAL(RESTStatus("/rest/block/nothex.json", strBody), HTTP_BAD_REQUEST);
+    BOOST_CHECK_EQUAL(RESTStatus("/rest/headers/0/" + strHash + ".bin", strBody), HTTP_BAD_REQUEST);
+    BOOST_CHECK_EQUAL(RESTStatus("/rest/getutxos/" + strHash + ".json", strBody), HTTP_BAD_REQUEST);
+    BOOST_CHECK_EQUAL(RESTStatus("/rest/unknown/" + strHash + ".bin", strBody), HTTP_NOT_FOUND);
+
+    // an outpoint that does not exist is reported as not found in the bitmap
+    BOOST_CHECK_EQUAL(RESTStatus("/rest/getutxos/checkmempool/" + strHash + "-0.json", strBody), HTTP_OK);
+    Value val;
+    BOOST_CHECK(ReadJSON(strBody, val));
+    BOOST_CHECK_EQUAL(find_value(val.get_obj(), "bitmap").get_str(), "0");
+    BOOST_CHECK(find_value(val.get_obj(), "utxos").get_array().empty());
+}
+
+BOOST_AUTO_TEST_CASE(rpc_readjson)
+{
+    // ReadJSON must accept and reject the same documents as read_string
+    const char* vstrJSON[] = {
+        "{}",
+        " [1, -2, 3.5, -0.25, true, false, null, \"a\\\"b\\n\\u0041\\/\"] ",
+        "{\"method\":\"getblock\",\"params\":[\"00ab\", {\"a\":[]}],\"id\":1}",
+        "[18446744073709551615, -9223372036854775808, 1.5e3, 2E-2]",
+        "{\"a\":1}garbage",
+        "[1,]",
+        "{\"a\" 1}",
+        "\"unterminated",
+        "[18446744073709551616]",
+        "tru",
+    };
+    BOOST_FOREACH(const char* pszJSON, vstrJSON)
+    {
+        Value valExpected, val;
+        bool fExpected = read_string(string(pszJSON), valExpected);
+        BOOST_CHECK_EQUAL(ReadJSON(pszJSON, val), fExpected);
+        if (fExpected)
+            BOOST_CHECK_EQUAL(write_string(val, false), write_string(valExpected, false));
+    }
+
+    // deep nesting is refused instead of overflowing the stack
+    Value val;
+    BOOST_CHECK(!ReadJSON(string(100000, '['), val));
+}
+
+// Average time of nRuns calls of fn, in microseconds
+template<typename F>
+static double TimeCalls(F fn, int nRuns)
+{
+    int64 nStart = GetTimeMicros();
+    for (int i = 0; i < nRuns; i++)
+        fn();
+    return (GetTimeMicros() - nStart) / (double)nRuns;
+}
+
+static string strTimingJSON;
+static void TimeReadString() { Value val; read_string(strTimingJSON, val); }
+static void TimeReadJSON() { Value val; ReadJSON(strTimingJSON, val); }
+
+BOOST_AUTO_TEST_CASE(rpc_readjson_timing)
+{
+    // Compares ReadJSON with read_string on a large hex parameter and on a
+    // large batch. The times are only reported, run with
+    // --log_level=message to see them.
+    string strHexRequest = "{\"method\":\"sendrawtransaction\",\"params\":[\"" + string(200000, 'a') + "\"],\"id\":1}";
+    string strBatch = "[";
+    for (int i = 0; i < 1000; i++)
+        strBatch += strprintf("%s{\"method\":\"getblock\",\"params\":[\"%s\",true],\"id\":%d}",
+                              i ? "," : "", uint256(i).GetHex().c_str(), i);
+    strBatch += "]";
+
+    const string* vpstr[] = { &strHexRequest, &strBatch };
+    const char* vpszName[] = { "200 kB hex parameter", "batch of 1000 getblock requests" };
+    for (int i = 0; i < 2; i++)
+    {
+        strTimingJSON = *vpstr[i];
+        Value valExpected, val;
+        BOOST_CHECK(read_string(strTimingJSON, valExpected));
+        BOOST_CHECK(ReadJSON(strTimingJSON, val));
+        BOOST_CHECK(write_string(val, false) == write_string(valExpected, false));
+
+        double dReadString = TimeCalls(TimeReadString, 20);
+        double dReadJSON = TimeCalls(TimeReadJSON, 20);
+        BOOST_TEST_MESSAGE(strprintf("%s: read_string %.0f us, ReadJSON %.0f us",
+                                     vpszName[i], dReadString, dReadJSON));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rpc_stats)
+{
+    Array params;
+    params.push_back(true);
+    tableRPC.execute("getrpcstats", params);
+
+    // calls through the table are counted, failures as errors
+    tableRPC.execute("getblockcount", Array());
+    tableRPC.execute("getblockcount", Array());
+    BOOST_CHECK_THROW(tableRPC.execute("getblockhash", Array()), Object);
+
+    Object stats = tableRPC.execute("getrpcstats", params).get_obj();
+    const Object& blockcount = find_value(stats, "getblockcount").get_obj();
+    BOOST_CHECK_EQUAL(find_value(blockcount, "calls").get_int64(), 2);
+    BOOST_CHECK_EQUAL(find_value(blockcount, "errors").get_int64(), 0);
+    int64 nCalls = 0;
+    BOOST_FOREACH(const Value& bucket, find_value(find_value(blockcount, "exec").get_obj(), "histogram").get_array())
+        nCalls += bucket.get_int64();
+    BOOST_CHECK_EQUAL(nCalls, 2);
+    const Object& blockhash = find_value(stats, "getblockhash").get_obj();
+    BOOST_CHECK_EQUAL(find_value(blockhash, "errors").get_int64(), 1);
+
+    // reset cleared everything but the call that returned the statistics
+    stats = tableRPC.execute("getrpcstats", Array()).get_obj();
+    BOOST_CHECK(find_value(stats, "getblockcount").type() == null_type);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,8 @@
 #include <vector>
 
 #include "serialize.h"
+#include "hash.h"
+#include "main.h"
 
 using namespace std;
 
@@ -42,4 +44,77 @@ BOOST_AUTO_TEST_CASE(varints)
 
 }
 
+BOOST_AUTO_TEST_CASE(securestream)
+{
+    // a secure stream reads and writes like a plain one, and converts both ways
+    CSecureDataStream ssSecure(SER_DISK, 0);
+    ssSecure << string("secret") << 42;
+    CDataStream ss(vector<char>(ssSecure.begin(), ssSecure.end()), SER_DISK, 0);
+    BOOST_CHECK_EQUAL(ss.str(), ssSecure.str());
+
+    CSecureDataStream ssCopy(vector<char>(ss.begin(), ss.end()), SER_DISK, 0);
+    string str;
+    int n = 0;
+    ssCopy >> str >> n;
+    BOOST_CHECK_EQUAL(str, "secret");
+    BOOST_CHECK_EQUAL(n, 42);
+    BOOST_CHECK(ssCopy.empty());
+}
+
+BOOST_AUTO_TEST_CASE(fixedhashwriter)
+{
+    // hashes the same as a CDataStream, and as a CHashWriter, with the same contents
+    uint256 hash = 12345;
+    uint64 nModifier = 0x0123456789abcdefULL;
+    unsigned int nTime = 1400000000;
+
+    CDataStream ss(SER_GETHASH, 0);
+    ss << hash << nModifier << nTime;
+    CFixedHashWriter<sizeof(uint256) + sizeof(uint64) + sizeof(unsigned int)> ssFixed(SER_GETHASH, 0);
+    ssFixed << hash << nModifier << nTime;
+    CHashWriter ssHash(SER_GETHASH, 0);
+    ssHash << hash << nModifier << nTime;
+
+    BOOST_CHECK(ssFixed.GetHash() == Hash(ss.begin(), ss.end()));
+    BOOST_CHECK(ssHash.GetHash() == Hash(ss.begin(), ss.end()));
+
+    CFixedHashWriter<1> ssEmpty(SER_GETHASH, 0);
+    BOOST_CHECK(ssEmpty.GetHash() == Hash(ss.end(), ss.end()));
+}
+
+// The serialized size matches what is written, in a stream and in a vector
+template<typename T>
+static bool CheckSerializeSize(const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << obj;
+    CDataStream ssVector(SER_NETWORK, PROTOCOL_VERSION);
+    vector<T> v(300, obj);
+    ssVector << v;
+    return ::GetSerializeSize(obj, SER_NETWORK, PROTOCOL_VERSION) == ss.size() &&
+           ::GetSerializeSize(v, SER_NETWORK, PROTOCOL_VERSION) == ssVector.size();
+}
+
+BOOST_AUTO_TEST_CASE(fixedsize)
+{
+    BOOST_CHECK(CSerializeFixedSize<uint256>::fFixed);
+    BOOST_CHECK(!CSerializeFixedSize<CTransaction>::fFixed);
+    BOOST_CHECK(!CSerializeFixedSize<CBlock>::fFixed);
+
+    BOOST_CHECK(CheckSerializeSize(uint160(7)));
+    BOOST_CHECK(CheckSerializeSize(uint256(7)));
+    BOOST_CHECK(CheckSerializeSize(COutPoint(7, 1)));
+    BOOST_CHECK(CheckSerializeSize(CBlockHeader()));
+    BOOST_CHECK(CheckSerializeSize(CInv(MSG_TX, 7)));
+
+    CTransaction tx;
+    tx.vin.push_back(CTxIn(COutPoint(7, 1), CScript() << vector<unsigned char>(72, 1)));
+    tx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+    BOOST_CHECK(CheckSerializeSize(tx));
+
+    CBlock block;
+    block.vtx.push_back(tx);
+    BOOST_CHECK(CheckSerializeSize(block));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
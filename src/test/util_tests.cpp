@@ -30,6 +30,46 @@ BOOST_AUTO_TEST_CASE(util_criticalsection)
     } while(0);
 }
 
+BOOST_AUTO_TEST_CASE(util_lockprofile)
+{
+    CCriticalSection cs;
+    vector<CLockSiteStats> vStats;
+    GetLockProfile(vStats, true);
+
+    fLockProfile = true;
+    for (int i = 0; i < 3; i++)
+    {
+        LOCK(cs);
+    }
+    {
+        TRY_LOCK(cs, lockTest);
+        bool fLocked = lockTest;
+        BOOST_CHECK(fLocked);
+    }
+    fLockProfile = false;
+    {
+        LOCK(cs);
+    }
+
+    // one site for the loop and one for TRY_LOCK, locks taken while disabled are not counted
+    GetLockProfile(vStats, true);
+    BOOST_CHECK_EQUAL(vStats.size(), 2U);
+    int64 nLocks = 0;
+    BOOST_FOREACH(const CLockSiteStats& stats, vStats)
+    {
+        BOOST_CHECK_EQUAL(string(stats.pszName), "cs");
+        int64 nHistogram = 0;
+        for (int i = 0; i < CLockSiteStats::HISTOGRAM_BUCKETS; i++)
+            nHistogram += stats.vHoldHistogram[i];
+        BOOST_CHECK_EQUAL(nHistogram, stats.nLocks);
+        nLocks += stats.nLocks;
+    }
+    BOOST_CHECK_EQUAL(nLocks, 4);
+
+    GetLockProfile(vStats);
+    BOOST_CHECK(vStats.empty());
+}
+
 BOOST_AUTO_TEST_CASE(util_MedianFilter)
 {    
     CMedianFilter<int> filter(5, 15);
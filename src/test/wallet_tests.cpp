@@ -2,6 +2,7 @@
 
 #include "main.h"
 #include "wallet.h"
+#include "kernelrecord.h"
 
 // how many times to run all the tests to have a chance to catch errors that only show up with particular random shuffles
 #define RUN_TESTS 100
@@ -208,6 +209,18 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         BOOST_CHECK_EQUAL(nValueRet, 500000 * COIN); // we should get the exact amount
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 10U); // in ten coins
 
+        // an exact subset is found whenever there is one, even among many
+        // coins that can't be part of it: 0.07+0.11+0.23 = 0.41
+        empty_wallet();
+        add_coin( 7*CENT);
+        add_coin(11*CENT);
+        add_coin(23*CENT);
+        for (int i = 0; i < 500; i++)
+            add_coin(40*CENT + i);
+        BOOST_CHECK( wallet.SelectCoinsMinConf(41 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 41 * CENT);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 3U);
+
         // if there's not enough in the smaller coins to make at least 1 cent change (0.5+0.6+0.7 < 1.0+1.0),
         // we need to try finding an exact subset anyway
 
@@ -291,4 +304,159 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+BOOST_AUTO_TEST_CASE(coin_index_tests)
+{
+    CWallet keywallet;
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(keywallet.AddKey(key));
+
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+
+    CTransaction tx;
+    tx.vout.resize(3);
+    tx.vout[0].nValue = 5 * CENT;
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    tx.vout[1].nValue = 3 * CENT;
+    tx.vout[1].scriptPubKey.SetDestination(keyOther.GetPubKey().GetID());
+    tx.vout[2].nValue = 0;
+    tx.vout[2].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    uint256 hash = tx.GetHash();
+
+    CWalletTx& wtx = keywallet.mapWallet[hash];
+    wtx = CWalletTx(&keywallet, tx);
+
+    // only our own output with a non-zero value is indexed
+    keywallet.UpdateCoinIndex(wtx);
+    BOOST_CHECK_EQUAL(keywallet.mapCoins.size(), 1U);
+    BOOST_CHECK(keywallet.mapCoins.count(COutPoint(hash, 0)));
+    BOOST_CHECK_EQUAL(keywallet.mapCoins[COutPoint(hash, 0)].nValue, 5 * CENT);
+
+    // spending removes it, unspending brings it back
+    wtx.MarkSpent(0);
+    keywallet.UpdateCoinIndex(wtx);
+    BOOST_CHECK(keywallet.mapCoins.empty());
+    wtx.MarkUnspent(0);
+    keywallet.ReindexCoins();
+    BOOST_CHECK_EQUAL(keywallet.mapCoins.size(), 1U);
+
+    // a key added later makes the other output ours after a reindex, but
+    // only a reindex after the key is known (importprivkey order)
+    keywallet.MarkDirty();
+    BOOST_CHECK(keywallet.AddKey(keyOther));
+    BOOST_CHECK_EQUAL(keywallet.mapCoins.size(), 1U);
+    keywallet.MarkDirty();
+    BOOST_CHECK_EQUAL(keywallet.mapCoins.size(), 2U);
+
+    // adding a script reindexes by itself
+    CScript inner;
+    inner << key.GetPubKey() << OP_CHECKSIG;
+    CTransaction txScript;
+    txScript.vout.resize(1);
+    txScript.vout[0].nValue = 2 * CENT;
+    txScript.vout[0].scriptPubKey.SetDestination(inner.GetID());
+    uint256 hashScript = txScript.GetHash();
+    keywallet.mapWallet[hashScript] = CWalletTx(&keywallet, txScript);
+    BOOST_CHECK_EQUAL(keywallet.mapCoins.size(), 2U);
+    BOOST_CHECK(keywallet.AddCScript(inner));
+    BOOST_CHECK_EQUAL(keywallet.mapCoins.size(), 3U);
+    BOOST_CHECK(keywallet.mapCoins.count(COutPoint(hashScript, 0)));
+}
+
+BOOST_AUTO_TEST_CASE(load_wallet_index_tests)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 5 * CENT;
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    CWalletTx wtx(NULL, tx);
+    wtx.nOrderPos = 0;
+
+    {
+        CWalletDB walletdb("wallet_load_test.dat", "cr+");
+        BOOST_CHECK(walletdb.WriteKey(key.GetPubKey(), key.GetPrivKey(), CKeyMetadata(GetTime())));
+        BOOST_CHECK(walletdb.WriteTx(tx.GetHash(), wtx));
+        // a tx record whose hash does not match its contents is corrupt
+        BOOST_CHECK(walletdb.WriteTx(GetRandHash(), wtx));
+
+        CAccountingEntry acentry;
+        acentry.strAccount = "test";
+        acentry.nCreditDebit = CENT;
+        acentry.nTime = GetTime();
+        acentry.nOrderPos = 1;
+        BOOST_CHECK(walletdb.WriteAccountingEntry(acentry));
+    }
+
+    // the load carries on past the bad record and indexes what it read
+    CWallet loadwallet("wallet_load_test.dat");
+    bool fFirstRun;
+    BOOST_CHECK_EQUAL(loadwallet.LoadWallet(fFirstRun), DB_NONCRITICAL_ERROR);
+    BOOST_CHECK_EQUAL(loadwallet.mapWallet.size(), 1U);
+    BOOST_CHECK_EQUAL(loadwallet.mapCoins.size(), 1U);
+    BOOST_CHECK(loadwallet.mapCoins.count(COutPoint(tx.GetHash(), 0)));
+    BOOST_CHECK_EQUAL(loadwallet.laccentries.size(), 1U);
+    BOOST_CHECK_EQUAL(loadwallet.OrderedTxItems().size(), 2U);
+    mapArgs.erase("-rescan");
+}
+
+BOOST_AUTO_TEST_CASE(key_birthday_tests)
+{
+    CWallet keywallet;
+    BOOST_CHECK_EQUAL(keywallet.nTimeFirstKey, 0);
+
+    // generated keys record their creation time
+    int64 nNow = GetTime();
+    CKeyID keyid = keywallet.GenerateNewKey().GetID();
+    BOOST_CHECK(keywallet.mapKeyMetadata[keyid].nCreateTime >= nNow);
+    BOOST_CHECK_EQUAL(keywallet.nTimeFirstKey, keywallet.mapKeyMetadata[keyid].nCreateTime);
+
+    // the earliest creation time wins
+    keywallet.UpdateTimeFirstKey(nNow - 1000);
+    BOOST_CHECK_EQUAL(keywallet.nTimeFirstKey, nNow - 1000);
+    keywallet.UpdateTimeFirstKey(nNow + 1000);
+    BOOST_CHECK_EQUAL(keywallet.nTimeFirstKey, nNow - 1000);
+
+    // an imported key may be arbitrarily old
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(keywallet.AddKey(key));
+    BOOST_CHECK_EQUAL(keywallet.nTimeFirstKey, 1);
+}
+
+BOOST_AUTO_TEST_CASE(minting_probability_tests)
+{
+    double difficulty = 0.5;
+    int64 nNow = GetAdjustedTime();
+    int64 nTimes[] = { nNow, nNow - nStakeMinAge - 86400 / 2, nNow - 10 * 86400, nNow - STAKE_MAX_AGE - 86400 };
+    int nMinutes[] = { 10, 60 * 24, 60 * 24 * 30 + 10, 60 * 24 * 90 };
+
+    BOOST_FOREACH(int64 nTime, nTimes)
+    {
+        BOOST_FOREACH(int minutes, nMinutes)
+        {
+            KernelRecord kr(uint256(), nTime, "", 1000 * COIN, 0, false, 0);
+
+            // product of the chances not to mint over each day of the interval
+            double prob = 1;
+            int d = minutes / (60 * 24);
+            for (int i = 0; i < d; i++)
+                prob *= pow(1 - kr.getProbToMintStake(difficulty, i * 86400), 86400);
+            prob *= pow(1 - kr.getProbToMintStake(difficulty, d * 86400), 60 * (minutes % (60 * 24)));
+            prob = 1 - prob;
+
+            BOOST_CHECK_CLOSE(kr.getProbToMintWithinNMinutes(difficulty, minutes), prob, 0.01);
+        }
+    }
+
+    // outputs younger than the minimum age cannot mint
+    KernelRecord krYoung(uint256(), nNow, "", 1000 * COIN, 0, false, 0);
+    BOOST_CHECK_EQUAL(krYoung.getProbToMintWithinNMinutes(difficulty, 10), 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
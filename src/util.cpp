@@ -41,6 +41,7 @@ namespace boost {
 #include <openssl/crypto.h>
 #include <openssl/rand.h>
 #include <stdarg.h>
+#include <set>
 
 #ifdef WIN32
 #ifdef _MSC_VER
@@ -232,6 +233,22 @@ static boost::once_flag debugPrintInitFlag = BOOST_ONCE_INIT;
 static FILE* fileout = NULL;
 static boost::mutex* mutexDebugLog = NULL;
 
+// While the writer thread runs (see StartDebugLogWriter), messages are
+// appended to pstrDebugLogQueue and written to debug.log by the writer in
+// batches, so that logging threads only copy them under mutexDebugLog.
+// Otherwise they are written directly. All of these are guarded by
+// mutexDebugLog, and like it never destroyed.
+static std::string* pstrDebugLogQueue = NULL;
+static boost::condition_variable* condDebugLogQueued = NULL;   // messages queued, or stop requested
+static boost::condition_variable* condDebugLogWritten = NULL;  // the writer took or wrote a batch
+static boost::thread* threadDebugLogWriter = NULL;
+static bool fDebugLogAsync = false;
+static bool fDebugLogWriting = false;
+static bool fStopDebugLogWriter = false;
+
+// Logging threads wait when this much is queued
+static const size_t MAX_DEBUG_LOG_QUEUE = 16 * 1024 * 1024;
+
 static void DebugPrintInit()
 {
     assert(fileout == NULL);
@@ -242,6 +259,112 @@ static void DebugPrintInit()
     if (fileout) setbuf(fileout, NULL); // unbuffered
 
     mutexDebugLog = new boost::mutex();
+    pstrDebugLogQueue = new std::string();
+    condDebugLogQueued = new boost::condition_variable();
+    condDebugLogWritten = new boost::condition_variable();
+}
+
+// Write to debug.log, by the writer thread or with mutexDebugLog held
+static void WriteDebugLog(const char* pch, size_t nSize)
+{
+    // reopen the log file, if requested
+    if (fReopenDebugLog) {
+        fReopenDebugLog = false;
+        boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
+        if (freopen(pathDebug.string().c_str(),"a",fileout) != NULL)
+            setbuf(fileout, NULL); // unbuffered
+    }
+
+    fwrite(pch, 1, nSize, fileout);
+}
+
+static void ThreadDebugLogWriter()
+{
+    RenameThread("peercoin-log");
+
+    std::string strBatch;
+    boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+    while (true)
+    {
+        while (pstrDebugLogQueue->empty() && !fStopDebugLogWriter)
+            condDebugLogQueued->wait(scoped_lock);
+        if (pstrDebugLogQueue->empty())
+            break;
+
+        // Everything queued is written at once, without holding the lock
+        strBatch.swap(*pstrDebugLogQueue);
+        fDebugLogWriting = true;
+        condDebugLogWritten->notify_all();
+        scoped_lock.unlock();
+        WriteDebugLog(strBatch.data(), strBatch.size());
+        strBatch.clear();
+        scoped_lock.lock();
+        fDebugLogWriting = false;
+        condDebugLogWritten->notify_all();
+    }
+
+    // Messages logged from now on are written directly
+    fDebugLogAsync = false;
+}
+
+void StartDebugLogWriter()
+{
+    if (fPrintToConsole || fPrintToDebugger)
+        return;
+    boost::call_once(&DebugPrintInit, debugPrintInitFlag);
+    if (fileout == NULL)
+        return;
+
+    boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+    if (threadDebugLogWriter)
+        return;
+    fStopDebugLogWriter = false;
+    fDebugLogAsync = true;
+    threadDebugLogWriter = new boost::thread(&ThreadDebugLogWriter);
+}
+
+void StopDebugLogWriter()
+{
+    boost::thread* pthread;
+    {
+        if (mutexDebugLog == NULL)
+            return;
+        boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+        if (threadDebugLogWriter == NULL)
+            return;
+        fStopDebugLogWriter = true;
+        condDebugLogQueued->notify_all();
+        pthread = threadDebugLogWriter;
+        threadDebugLogWriter = NULL;
+    }
+    // The writer exits once everything queued is written
+    pthread->join();
+    delete pthread;
+}
+
+void FlushDebugLog()
+{
+    if (mutexDebugLog == NULL)
+        return;
+    boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+    while (fDebugLogAsync && (!pstrDebugLogQueue->empty() || fDebugLogWriting))
+        condDebugLogWritten->wait(scoped_lock);
+}
+
+bool LogAcceptCategory(const char* pszCategory)
+{
+    // The categories are read once per thread, mapMultiArgs is not locked
+    static boost::thread_specific_ptr<set<string> > ptrCategory;
+    if (ptrCategory.get() == NULL)
+    {
+        const vector<string>& categories = mapMultiArgs["-debug"];
+        ptrCategory.reset(new set<string>(categories.begin(), categories.end()));
+    }
+
+    // -debug without a category, or -debug=1, enables them all
+    const set<string>& setCategories = *ptrCategory.get();
+    return setCategories.count(string("")) || setCategories.count(string("1")) ||
+           setCategories.count(string(pszCategory));
 }
 
 int OutputDebugStringF(const char* pszFormat, ...)
@@ -263,28 +386,40 @@ int OutputDebugStringF(const char* pszFormat, ...)
         if (fileout == NULL)
             return ret;
 
-        boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
-
-        // reopen the log file, if requested
-        if (fReopenDebugLog) {
-            fReopenDebugLog = false;
-            boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
-            if (freopen(pathDebug.string().c_str(),"a",fileout) != NULL)
-                setbuf(fileout, NULL); // unbuffered
+        // Formatted before taking the lock, the timestamp in case the message starts a line
+        std::string strTimestamp;
+        if (fLogTimestamps)
+        {
+            int64 nTimeMicros = GetTimeMicros();
+            strTimestamp = DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nTimeMicros / 1000000) +
+                           strprintf(".%06d ", (int)(nTimeMicros % 1000000));
         }
-
-        // Debug print useful for profiling
-        if (fLogTimestamps && fStartedNewLine)
-            ret += fprintf(fileout, "%s ", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", GetTime()).c_str());
-        if (pszFormat[strlen(pszFormat) - 1] == '\n')
-            fStartedNewLine = true;
-        else
-            fStartedNewLine = false;
-
         va_list arg_ptr;
         va_start(arg_ptr, pszFormat);
-        ret += vfprintf(fileout, pszFormat, arg_ptr);
+        std::string strMessage = vstrprintf(pszFormat, arg_ptr);
         va_end(arg_ptr);
+
+        boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+
+        if (!fStartedNewLine)
+            strTimestamp.clear();
+        fStartedNewLine = !strMessage.empty() && strMessage[strMessage.size() - 1] == '\n';
+        ret += strTimestamp.size() + strMessage.size();
+
+        if (fDebugLogAsync)
+        {
+            while (pstrDebugLogQueue->size() >= MAX_DEBUG_LOG_QUEUE && !fStopDebugLogWriter)
+                condDebugLogWritten->wait(scoped_lock);
+            if (pstrDebugLogQueue->empty())
+                condDebugLogQueued->notify_one();
+            pstrDebugLogQueue->append(strTimestamp);
+            pstrDebugLogQueue->append(strMessage);
+        }
+        else
+        {
+            WriteDebugLog(strTimestamp.data(), strTimestamp.size());
+            WriteDebugLog(strMessage.data(), strMessage.size());
+        }
     }
 
 #ifdef WIN32
@@ -1025,6 +1160,7 @@ void PrintException(std::exception* pex, const char* pszThread)
 {
     std::string message = FormatException(pex, pszThread);
     printf("\n\n************************\n%s\n", message.c_str());
+    FlushDebugLog();
     fprintf(stderr, "\n\n************************\n%s\n", message.c_str());
     strMiscWarning = message;
     throw;
@@ -1032,6 +1168,7 @@ void PrintException(std::exception* pex, const char* pszThread)
 
 void LogStackTrace() {
     printf("\n\n******* exception encountered *******\n");
+    FlushDebugLog();
     if (fileout)
     {
 #ifndef WIN32
@@ -1047,6 +1184,7 @@ void PrintExceptionContinue(std::exception* pex, const char* pszThread)
 {
     std::string message = FormatException(pex, pszThread);
     printf("\n\n************************\n%s\n", message.c_str());
+    FlushDebugLog();
     fprintf(stderr, "\n\n************************\n%s\n", message.c_str());
     strMiscWarning = message;
 }
@@ -174,6 +174,13 @@ extern int64 nTimeShift;
 void RandAddSeed();
 void RandAddSeedPerfmon();
 int ATTR_WARN_PRINTF(1,2) OutputDebugStringF(const char* pszFormat, ...);
+/** Write debug.log from a background thread, until StopDebugLogWriter has written everything queued */
+void StartDebugLogWriter();
+void StopDebugLogWriter();
+/** Wait until everything logged so far is written */
+void FlushDebugLog();
+/** Whether -debug enables messages of a category */
+bool LogAcceptCategory(const char* pszCategory);
 
 /*
   Rationale for the real_strprintf / strprintf construction:
@@ -201,6 +208,11 @@ bool ATTR_WARN_PRINTF(1,2) error(const char *format, ...);
  */
 #define printf OutputDebugStringF
 
+/* Print to debug.log if -debug enables the category. The arguments are only
+ * evaluated, and the message formatted, when it does.
+ */
+#define LogPrint(category, ...) (LogAcceptCategory(category) ? OutputDebugStringF(__VA_ARGS__) : 0)
+
 void LogException(std::exception* pex, const char* pszThread);
 void PrintException(std::exception* pex, const char* pszThread);
 void PrintExceptionContinue(std::exception* pex, const char* pszThread);
@@ -13,6 +13,7 @@
 #include "kernel.h"
 #include "base58.h"
 #include "txdb.h"
+#include "blockview.h"
 #include <boost/algorithm/string/replace.hpp>
 
 using namespace std;
@@ -32,6 +33,39 @@ struct CompareValueOnly
     }
 };
 
+// The database of the open batch of the calling thread, or a handle of its
+// own when there is none. Every access made during a batch must go through
+// the batch: another handle is another BDB locker, and waits for the locks
+// that the batch transaction of this same thread holds.
+class CWalletDBHandle
+{
+private:
+    CWalletDB* pwalletdb;
+    bool fOwned;
+
+    CWalletDBHandle(const CWalletDBHandle&);
+    CWalletDBHandle& operator=(const CWalletDBHandle&);
+
+public:
+    explicit CWalletDBHandle(const CWallet* pwallet) : pwalletdb(pwallet->GetBatchDB()), fOwned(false)
+    {
+        if (!pwalletdb)
+        {
+            pwalletdb = new CWalletDB(pwallet->strWalletFile);
+            fOwned = true;
+        }
+    }
+
+    ~CWalletDBHandle()
+    {
+        if (fOwned)
+            delete pwalletdb;
+    }
+
+    CWalletDB* operator->() const { return pwalletdb; }
+    CWalletDB& operator*() const { return *pwalletdb; }
+};
+
 CPubKey CWallet::GenerateNewKey()
 {
     bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
@@ -44,6 +78,13 @@ CPubKey CWallet::GenerateNewKey()
     if (fCompressed)
         SetMinVersion(FEATURE_COMPRPUBKEY);
 
+    return AddNewKey(key);
+}
+
+// Add a freshly generated key, recording its creation time
+CPubKey CWallet::AddNewKey(const CKey& key)
+{
+    mapKeyMetadata[key.GetPubKey().GetID()] = CKeyMetadata(GetTime());
     if (!AddKey(key))
         throw std::runtime_error("CWallet::GenerateNewKey() : AddKey failed");
     return key.GetPubKey();
@@ -51,12 +92,16 @@ CPubKey CWallet::GenerateNewKey()
 
 bool CWallet::AddKey(const CKey& key)
 {
+    CPubKey pubkey = key.GetPubKey();
     if (!CCryptoKeyStore::AddKey(key))
         return false;
+    // imported keys have no metadata yet: their creation time is unknown
+    const CKeyMetadata& keyMeta = mapKeyMetadata[pubkey.GetID()];
+    UpdateTimeFirstKey(keyMeta.nCreateTime);
     if (!fFileBacked)
         return true;
     if (!IsCrypted())
-        return CWalletDB(strWalletFile).WriteKey(key.GetPubKey(), key.GetPrivKey());
+        return CWalletDBHandle(this)->WriteKey(pubkey, key.GetPrivKey(), keyMeta);
     return true;
 }
 
@@ -69,13 +114,28 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char
     {
         LOCK(cs_wallet);
         if (pwalletdbEncryption)
-            return pwalletdbEncryption->WriteCryptedKey(vchPubKey, vchCryptedSecret);
+            return pwalletdbEncryption->WriteCryptedKey(vchPubKey, vchCryptedSecret, mapKeyMetadata[vchPubKey.GetID()]);
         else
-            return CWalletDB(strWalletFile).WriteCryptedKey(vchPubKey, vchCryptedSecret);
+            return CWalletDBHandle(this)->WriteCryptedKey(vchPubKey, vchCryptedSecret, mapKeyMetadata[vchPubKey.GetID()]);
     }
     return false;
 }
 
+bool CWallet::LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &meta)
+{
+    UpdateTimeFirstKey(meta.nCreateTime);
+    mapKeyMetadata[pubkey.GetID()] = meta;
+    return true;
+}
+
+void CWallet::UpdateTimeFirstKey(int64 nCreateTime)
+{
+    if (nCreateTime == 0)
+        nTimeFirstKey = 1; // 0 would be considered 'no value'
+    else if (!nTimeFirstKey || nCreateTime < nTimeFirstKey)
+        nTimeFirstKey = nCreateTime;
+}
+
 bool CWallet::LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
     return CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret);
@@ -85,9 +145,11 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    // outputs to the script may already be in the wallet
+    MarkDirty();
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
+    return CWalletDBHandle(this)->WriteCScript(Hash160(redeemScript), redeemScript);
 }
 
 // ppcoin: optional setting to unlock wallet for block minting only;
@@ -108,7 +170,10 @@ bool CWallet::Unlock(const SecureString& strWalletPassphrase)
             if (!crypter.Decrypt(pMasterKey.second.vchCryptedKey, vMasterKey))
                 continue; // try another master key
             if (CCryptoKeyStore::Unlock(vMasterKey))
+            {
+                RequestKeyPoolTopUp();
                 return true;
+            }
         }
     }
     return false;
@@ -162,8 +227,7 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
 
 void CWallet::SetBestChain(const CBlockLocator& loc)
 {
-    CWalletDB walletdb(strWalletFile);
-    walletdb.WriteBestBlock(loc);
+    CWalletDBHandle(this)->WriteBestBlock(loc);
 }
 
 // This class implements an addrIncoming entry that causes pre-0.4
@@ -194,6 +258,8 @@ bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn,
 
     if (fFileBacked)
     {
+        if (!pwalletdbIn)
+            pwalletdbIn = GetBatchDB();
         CWalletDB* pwalletdb = pwalletdbIn ? pwalletdbIn : new CWalletDB(strWalletFile);
         if (nWalletVersion >= 40000)
         {
@@ -303,39 +369,142 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
     return true;
 }
 
+void CWallet::BeginBatch()
+{
+    ENTER_CRITICAL_SECTION(cs_wallet);
+    if (nBatchDepth++ > 0 || !fFileBacked)
+        return;
+    CWalletDB* pwalletdb = new CWalletDB(strWalletFile);
+    if (!pwalletdb->TxnBegin())
+    {
+        printf("CWallet::BeginBatch() : TxnBegin failed, writing records one by one\n");
+        delete pwalletdb;
+        return;
+    }
+    idBatchThread = boost::this_thread::get_id();
+    pwalletdbBatch = pwalletdb;
+}
+
+bool CWallet::CommitBatch()
+{
+    bool fRet = true;
+    if (--nBatchDepth == 0 && pwalletdbBatch)
+    {
+        CWalletDB* pwalletdb = pwalletdbBatch;
+        pwalletdbBatch = NULL;
+        fRet = pwalletdb->TxnCommit();
+        if (!fRet)
+            printf("CWallet::CommitBatch() : TxnCommit failed\n");
+        delete pwalletdb;
+    }
+    LEAVE_CRITICAL_SECTION(cs_wallet);
+    return fRet;
+}
+
+// The open batch, if it belongs to the calling thread
+CWalletDB* CWallet::GetBatchDB() const
+{
+    CWalletDB* pwalletdb = pwalletdbBatch;
+    if (pwalletdb && idBatchThread == boost::this_thread::get_id())
+        return pwalletdb;
+    return NULL;
+}
+
 int64 CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
 {
     int64 nRet = nOrderPosNext++;
     if (pwalletdb) {
         pwalletdb->WriteOrderPosNext(nOrderPosNext);
     } else {
-        CWalletDB(strWalletFile).WriteOrderPosNext(nOrderPosNext);
+        CWalletDBHandle(this)->WriteOrderPosNext(nOrderPosNext);
     }
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+// Remove one (key, value) pair from a multimap, leaving other values under the same key
+template<typename K, typename V>
+static void EraseFromMultimap(std::multimap<K, V>& mm, const K& key, const V& value)
 {
-    CWalletDB walletdb(strWalletFile);
+    typedef typename std::multimap<K, V>::iterator iterator;
+    std::pair<iterator, iterator> range = mm.equal_range(key);
+    for (iterator it = range.first; it != range.second; ++it)
+    {
+        if ((*it).second == value)
+        {
+            mm.erase(it);
+            return;
+        }
+    }
+}
+
+void CWallet::AddAccountingEntry(const CAccountingEntry& acentry)
+{
+    LOCK(cs_wallet);
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+}
+
+int64 CWallet::GetAccountCreditDebit(const string& strAccount) const
+{
+    int64 nCreditDebit = 0;
+    LOCK(cs_wallet);
+    BOOST_FOREACH(const CAccountingEntry& entry, laccentries)
+        if (entry.strAccount == strAccount)
+            nCreditDebit += entry.nCreditDebit;
+    return nCreditDebit;
+}
 
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
+// (Re)file a wallet transaction under the height of its block in mapTxByHeight.
+// Transactions whose block is unknown, or not in the main chain when
+// fInMainChain is false, are filed under -1.
+void CWallet::UpdateHeightIndex(CWalletTx& wtx, bool fInMainChain)
+{
+    LOCK(cs_wallet);
+    int nHeight = -1;
+    if (wtx.hashBlock != 0)
+    {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+        if (mi != mapBlockIndex.end() && (fInMainChain || (*mi).second->IsInMainChain()))
+            nHeight = (*mi).second->nHeight;
+    }
+    if (nHeight == wtx.nHeightIndexed)
+        return;
+    if (wtx.nHeightIndexed != -2)
+        EraseFromMultimap(mapTxByHeight, wtx.nHeightIndexed, &wtx);
+    mapTxByHeight.insert(make_pair(nHeight, &wtx));
+    wtx.nHeightIndexed = nHeight;
+}
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
+// Rebuild the activity log and height index, e.g. after loading the wallet
+void CWallet::ReindexTransactions()
+{
+    LOCK(cs_wallet);
+    wtxOrdered.clear();
+    mapTxByHeight.clear();
     for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
         CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        wtxOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        wtx->nHeightIndexed = -2;
+        UpdateHeightIndex(*wtx, false);
     }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+    BOOST_FOREACH(CAccountingEntry& entry, laccentries)
+        wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+}
+
+// The block containing this transaction was disconnected from the main chain
+void CWallet::DisconnectedTransaction(const uint256& hashTx)
+{
+    LOCK(cs_wallet);
+    map<uint256, CWalletTx>::iterator mi = mapWallet.find(hashTx);
+    if (mi != mapWallet.end() && (*mi).second.nHeightIndexed != -1)
     {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+        CWalletTx& wtx = (*mi).second;
+        EraseFromMultimap(mapTxByHeight, wtx.nHeightIndexed, &wtx);
+        mapTxByHeight.insert(make_pair(-1, &wtx));
+        wtx.nHeightIndexed = -1;
     }
-
-    return txOrdered;
 }
 
 void CWallet::WalletUpdateSpent(const CTransaction &tx)
@@ -358,6 +527,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                     printf("WalletUpdateSpent found spent coin %sppc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    UpdateCoinIndex(wtx);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -371,9 +541,46 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        // ownership of outputs may have changed (new keys or scripts)
+        ReindexCoins();
     }
 }
 
+CWalletCoin::CWalletCoin(const CWalletTx* ptxIn, unsigned int nIn)
+{
+    ptx = ptxIn;
+    n = nIn;
+    nValue = ptx->vout[n].nValue;
+    fCoinBase = ptx->IsCoinBase();
+    fCoinStake = ptx->IsCoinStake();
+}
+
+// Bring the coin index entries of one wallet transaction up to date
+// with its outputs' ownership and spent flags.
+void CWallet::UpdateCoinIndex(const CWalletTx& wtx)
+{
+    LOCK(cs_wallet);
+    uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        COutPoint outpoint(hash, i);
+        if (!wtx.IsSpent(i) && wtx.vout[i].nValue > 0 && IsMine(wtx.vout[i]))
+            mapCoins[outpoint] = CWalletCoin(&wtx, i);
+        else
+            mapCoins.erase(outpoint);
+    }
+    nCoinIndexVersion++;
+}
+
+void CWallet::ReindexCoins()
+{
+    LOCK(cs_wallet);
+    mapCoins.clear();
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        UpdateCoinIndex(item.second);
+    nCoinIndexVersion++;
+}
+
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
 {
     uint256 hash = wtxIn.GetHash();
@@ -388,6 +595,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         {
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
+            wtx.nHeightIndexed = -2;
+            wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (wtxIn.hashBlock != 0)
@@ -399,9 +608,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64 latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        const TxItems& txOrdered = wtxOrdered;
+                        for (TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
@@ -462,10 +670,16 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         //// debug print
         printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
+        // Also refiles transactions seen again in a reconnected block
+        UpdateHeightIndex(wtx);
+
         // Write to disk
         if (fInsertedNew || fUpdated)
+        {
             if (!wtx.WriteToDisk())
                 return false;
+            UpdateCoinIndex(wtx);
+        }
 #ifndef QT_GUI
         // If default receiving address gets used, replace it with a new one
         if (vchDefaultKey.IsValid()) {
@@ -533,8 +747,19 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
-            CWalletDB(strWalletFile).EraseTx(hash);
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            CWalletTx& wtx = (*mi).second;
+            for (unsigned int i = 0; i < wtx.vout.size(); i++)
+                mapCoins.erase(COutPoint(hash, i));
+            nCoinIndexVersion++;
+            EraseFromMultimap(wtxOrdered, wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0));
+            if (wtx.nHeightIndexed != -2)
+                EraseFromMultimap(mapTxByHeight, wtx.nHeightIndexed, &wtx);
+            mapWallet.erase(mi);
+            CWalletDBHandle(this)->EraseTx(hash);
+        }
     }
     return true;
 }
@@ -784,31 +1009,259 @@ void CWalletTx::AddSupportingTransactions()
 
 bool CWalletTx::WriteToDisk()
 {
-    return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
+    return CWalletDBHandle(pwallet)->WriteTx(GetHash(), *this);
 }
 
+// Compact description of the scripts that can pay to the wallet, so that
+// rescan worker threads can filter blocks without holding cs_wallet.
+// Matches are a superset of IsMine(); AddToWalletIfInvolvingMe confirms them.
+class CWalletScanFilter
+{
+public:
+    std::set<uint160> setIDs; // key IDs and P2SH script IDs
+
+    bool MatchScript(const CByteSpan& script) const
+    {
+        // Pay-to-pubkey-hash and pay-to-script-hash are recognized in place,
+        // other scripts are copied for Solver
+        const unsigned char* p = script.begin();
+        if (script.size() == 25 && p[0] == OP_DUP && p[1] == OP_HASH160 && p[2] == 20 &&
+            p[23] == OP_EQUALVERIFY && p[24] == OP_CHECKSIG)
+        {
+            uint160 hash;
+            memcpy(&hash, p + 3, sizeof(hash));
+            return setIDs.count(hash);
+        }
+        if (script.size() == 23 && p[0] == OP_HASH160 && p[1] == 20 && p[22] == OP_EQUAL)
+        {
+            uint160 hash;
+            memcpy(&hash, p + 2, sizeof(hash));
+            return setIDs.count(hash);
+        }
+
+        txnouttype whichType;
+        vector<vector<unsigned char> > vSolutions;
+        if (!Solver(script.ToScript(), whichType, vSolutions))
+            return false;
+        switch (whichType)
+        {
+        case TX_PUBKEY:
+            return setIDs.count(Hash160(vSolutions[0]));
+        case TX_PUBKEYHASH:
+        case TX_SCRIPTHASH:
+            return setIDs.count(uint160(vSolutions[0]));
+        case TX_MULTISIG:
+            for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+                if (setIDs.count(Hash160(vSolutions[i])))
+                    return true;
+            return false;
+        default:
+            return false;
+        }
+    }
+
+    bool MatchOutputs(const CTransactionView& tx) const
+    {
+        for (unsigned int i = 0; i < tx.nOuts; i++)
+            if (MatchScript(tx.pvout[i].scriptPubKey))
+                return true;
+        return false;
+    }
+};
+
+// A block read by a rescan worker thread. Only blocks with a matching
+// transaction are deserialized, by the scanning thread.
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    CBlockView view;
+    std::vector<uint256> vTxHash;
+    std::vector<bool> vMatch;
+};
+
+// The worker threads of one rescan. They are started once and read the
+// blocks of every chunk passed to Read() in parallel.
+class CRescanWorkers
+{
+private:
+    const CWalletScanFilter& filter;
+    boost::mutex mutex;
+    boost::condition_variable condWorker; // a chunk to read, or quit
+    boost::condition_variable condMaster; // the chunk has been read
+    std::vector<CRescanBlock>* pvBlocks;
+    unsigned int nNext; // next block of the chunk to hand out
+    unsigned int nTodo; // blocks of the chunk not read yet
+    bool fQuit;
+    boost::thread_group threadGroup;
+
+    CRescanWorkers(const CRescanWorkers&);
+    CRescanWorkers& operator=(const CRescanWorkers&);
+
+    void ReadBlock(CRescanBlock& item) const
+    {
+        item.view.ReadFromDisk(item.pindex);
+        BOOST_FOREACH(const CTransactionView& tx, item.view.vtx)
+        {
+            item.vTxHash.push_back(tx.GetHash());
+            item.vMatch.push_back(filter.MatchOutputs(tx));
+        }
+    }
+
+    void Loop()
+    {
+        RenameThread("peercoin-rescan");
+        boost::unique_lock<boost::mutex> lock(mutex);
+        ploop
+        {
+            while (!fQuit && (!pvBlocks || nNext >= pvBlocks->size()))
+                condWorker.wait(lock);
+            if (fQuit)
+                return;
+            CRescanBlock& item = (*pvBlocks)[nNext++];
+            lock.unlock();
+            ReadBlock(item);
+            lock.lock();
+            if (--nTodo == 0)
+                condMaster.notify_one();
+        }
+    }
+
+public:
+    CRescanWorkers(const CWalletScanFilter& filterIn, unsigned int nThreads) :
+        filter(filterIn), pvBlocks(NULL), nNext(0), nTodo(0), fQuit(false)
+    {
+        for (unsigned int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CRescanWorkers::Loop, this));
+    }
+
+    ~CRescanWorkers()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+        }
+        condWorker.notify_all();
+        threadGroup.join_all();
+    }
+
+    // Returns once every block of the chunk has been read
+    void Read(std::vector<CRescanBlock>& vBlocks)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        pvBlocks = &vBlocks;
+        nNext = 0;
+        nTodo = vBlocks.size();
+        condWorker.notify_all();
+        while (nTodo > 0)
+            condMaster.wait(lock);
+        pvBlocks = NULL;
+    }
+};
+
+// Serializes rescans, so that there is a single progress to report
+static CCriticalSection cs_rescan;
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+// Blocks are read and filtered by worker threads; cs_wallet is only
+// taken for transactions that pass the filter.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
+    int nBlocks = 0;
+    int64 nStart = GetTimeMillis();
+
+    LOCK(cs_rescan);
+
+    CWalletScanFilter filter;
+    set<uint256> setTxHash; // wallet transactions, whose outputs may be spent
+    {
+        LOCK2(cs_main, cs_wallet);
+        set<CKeyID> setKeys;
+        GetKeys(setKeys);
+        BOOST_FOREACH(const CKeyID& keyid, setKeys)
+            filter.setIDs.insert(keyid);
+        {
+            LOCK(cs_KeyStore);
+            BOOST_FOREACH(const PAIRTYPE(const CScriptID, CScript)& item, mapScripts)
+                filter.setIDs.insert(item.first);
+        }
+        BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+            setTxHash.insert(item.first);
 
+        // No transaction can involve a key before it was created; allow
+        // for block timestamps being up to two hours off
+        while (pindexStart && nTimeFirstKey && pindexStart->nTime < nTimeFirstKey - 7200)
+            pindexStart = pindexStart->pnext;
+
+        nScanStartHeight = nScanHeight = (pindexStart ? pindexStart->nHeight : nBestHeight);
+        nScanEndHeight = nBestHeight;
+    }
+    nScanStartTime = GetTime();
+    fAbortRescan = false;
+    fScanningWallet = true;
+
+    unsigned int nThreads = std::min(std::max(boost::thread::hardware_concurrency(), 1u), 8u);
+    CRescanWorkers workers(filter, nThreads);
     CBlockIndex* pindex = pindexStart;
+    while (pindex && !fAbortRescan)
     {
-        LOCK(cs_wallet);
-        while (pindex)
+        // Take the next blocks of the main chain. A block disconnected in
+        // the meantime has no pnext; blocks connected after it are synced
+        // with the wallet as usual.
+        std::vector<CRescanBlock> vBlocks;
+        {
+            LOCK(cs_main);
+            for (; pindex && vBlocks.size() < 16 * nThreads; pindex = pindex->pnext)
+            {
+                vBlocks.push_back(CRescanBlock());
+                vBlocks.back().pindex = pindex;
+            }
+            nScanEndHeight = nBestHeight;
+        }
+
+        workers.Read(vBlocks);
+
+        BOOST_FOREACH(CRescanBlock& item, vBlocks)
         {
             CBlock block;
-            block.ReadFromDisk(pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            bool fHaveBlock = false;
+            for (unsigned int i = 0; i < item.view.vtx.size(); i++)
             {
-                if (AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, fUpdate))
+                const CTransactionView& txview = item.view.vtx[i];
+                const uint256& hash = item.vTxHash[i];
+                bool fMatch = item.vMatch[i] || setTxHash.count(hash);
+                for (unsigned int j = 0; j < txview.nIns && !fMatch; j++)
+                    fMatch = setTxHash.count(txview.pvin[j].GetPrevHash());
+                if (!fMatch)
+                    continue;
+
+                if (!fHaveBlock)
+                {
+                    if (!item.view.GetBlock(block))
+                        break;
+                    fHaveBlock = true;
+                }
+                const CTransaction& tx = block.vtx[i];
+
+                LOCK2(cs_main, cs_wallet);
+                if (AddToWalletIfInvolvingMe(hash, tx, &block, fUpdate))
+                {
+                    setTxHash.insert(hash);
                     ret++;
+                }
             }
-            pindex = pindex->pnext;
+            nScanHeight = item.pindex->nHeight;
+            nBlocks++;
         }
     }
+    fScanningWallet = false;
+
+    if (fAbortRescan)
+        printf("ScanForWalletTransactions() : aborted at block %d\n", nScanHeight);
+    printf("ScanForWalletTransactions() : scanned %d blocks, found %d transactions in %" PRI64d"ms\n",
+           nBlocks, ret, GetTimeMillis() - nStart);
     return ret;
 }
 
@@ -817,50 +1270,60 @@ void CWallet::ReacceptWalletTransactions()
     bool fRepeat = true;
     while (fRepeat)
     {
-        LOCK(cs_wallet);
-        fRepeat = false;
-        bool fMissing = false;
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        // Earliest block that may contain a spend we missed
+        CBlockIndex* pindexRescan = NULL;
         {
-            CWalletTx& wtx = item.second;
-            if ((wtx.IsCoinBase() && wtx.IsSpent(0)) || (wtx.IsCoinStake() && wtx.IsSpent(1)))
-                continue;
-
-            CCoins coins;
-            bool fUpdated = false;
-            bool fFound = pcoinsTip->GetCoins(wtx.GetHash(), coins);
-            if (fFound || wtx.GetDepthInMainChain() > 0)
+            LOCK2(cs_main, cs_wallet);
+            fRepeat = false;
+            BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             {
-                // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
-                for (unsigned int i = 0; i < wtx.vout.size(); i++)
+                CWalletTx& wtx = item.second;
+                if ((wtx.IsCoinBase() && wtx.IsSpent(0)) || (wtx.IsCoinStake() && wtx.IsSpent(1)))
+                    continue;
+
+                CCoins coins;
+                bool fUpdated = false;
+                bool fFound = pcoinsTip->GetCoins(wtx.GetHash(), coins);
+                if (fFound || wtx.GetDepthInMainChain() > 0)
                 {
-                    if (wtx.IsSpent(i))
-                        continue;
-                    if ((i >= coins.vout.size() || coins.vout[i].IsNull()) && IsMine(wtx.vout[i]))
+                    // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
+                    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+                    {
+                        if (wtx.IsSpent(i))
+                            continue;
+                        if ((i >= coins.vout.size() || coins.vout[i].IsNull()) && IsMine(wtx.vout[i]))
+                        {
+                            wtx.MarkSpent(i);
+                            fUpdated = true;
+                        }
+                    }
+                    if (fUpdated)
                     {
-                        wtx.MarkSpent(i);
-                        fUpdated = true;
-                        fMissing = true;
+                        printf("ReacceptWalletTransactions found spent coin %sppc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
+                        wtx.MarkDirty();
+                        wtx.WriteToDisk();
+                        UpdateCoinIndex(wtx);
+
+                        // The spend cannot be older than the transaction itself
+                        CBlockIndex* pindex = pindexGenesisBlock;
+                        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+                        if (mi != mapBlockIndex.end() && (*mi).second->IsInMainChain())
+                            pindex = (*mi).second;
+                        if (pindex && (!pindexRescan || pindex->nHeight < pindexRescan->nHeight))
+                            pindexRescan = pindex;
                     }
                 }
-                if (fUpdated)
+                else
                 {
-                    printf("ReacceptWalletTransactions found spent coin %sppc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
-                    wtx.MarkDirty();
-                    wtx.WriteToDisk();
+                    // Re-accept any txes of ours that aren't already in a block
+                    if (!(wtx.IsCoinBase() || wtx.IsCoinStake()))
+                        wtx.AcceptWalletTransaction(false);
                 }
             }
-            else
-            {
-                // Re-accept any txes of ours that aren't already in a block
-                if (!(wtx.IsCoinBase() || wtx.IsCoinStake()))
-                    wtx.AcceptWalletTransaction(false);
-            }
         }
-        if (fMissing)
+        if (pindexRescan)
         {
-            // TODO: optimize this to scan just part of the block chain?
-            if (ScanForWalletTransactions(pindexGenesisBlock))
+            if (ScanForWalletTransactions(pindexRescan))
                 fRepeat = true;  // Found missing transactions: re-do re-accept.
         }
     }
@@ -942,63 +1405,84 @@ void CWallet::ResendWalletTransactions()
 //
 
 
-int64 CWallet::GetBalance() const
+// Compute all balance totals in one pass over the coin index. The result is
+// reused until either the best chain or the coin index changes.
+// Requires cs_wallet.
+void CWallet::CacheBalances() const
 {
-    int64 nTotal = 0;
+    if (hashBalancesBestChain == hashBestChain && nBalancesCoinIndexVersion == nCoinIndexVersion)
+        return;
+
+    int64 nBalance = 0, nUnconfirmed = 0, nImmature = 0, nStake = 0;
+    const CWalletTx* pcoinLast = NULL;
+    bool fFinal = false, fConfirmed = false, fImmature = false, fInMainChain = false;
+    for (map<COutPoint, CWalletCoin>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it)
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const CWalletCoin& coin = (*it).second;
+        const CWalletTx* pcoin = coin.ptx;
+
+        // outputs of the same transaction are adjacent in the index
+        if (pcoin != pcoinLast)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
+            fFinal = pcoin->IsFinal();
+            fConfirmed = pcoin->IsConfirmed();
+            fImmature = (coin.fCoinBase || coin.fCoinStake) && pcoin->GetBlocksToMaturity() > 0;
+            fInMainChain = fImmature && pcoin->IsInMainChain();
+            pcoinLast = pcoin;
+        }
+
+        if (fImmature)
+        {
+            // ppcoin: total coins staked (non-spendable until maturity)
+            if (coin.fCoinStake && fInMainChain)
+                nStake += coin.nValue;
+            if (coin.fCoinBase && fInMainChain)
+                nImmature += coin.nValue;
+            continue;
         }
+
+        if (fConfirmed)
+            nBalance += coin.nValue;
+        if (!fFinal || !fConfirmed)
+            nUnconfirmed += coin.nValue;
+        if (!MoneyRange(nBalance) || !MoneyRange(nUnconfirmed))
+            throw std::runtime_error("CWallet::CacheBalances() : value out of range");
     }
 
-    return nTotal;
+    nBalanceCached = nBalance;
+    nUnconfirmedBalanceCached = nUnconfirmed;
+    nImmatureBalanceCached = nImmature;
+    nStakeCached = nStake;
+    hashBalancesBestChain = hashBestChain;
+    nBalancesCoinIndexVersion = nCoinIndexVersion;
+}
+
+int64 CWallet::GetBalance() const
+{
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nBalanceCached;
 }
 
 int64 CWallet::GetUnconfirmedBalance() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nUnconfirmedBalanceCached;
 }
 
-// ppcoin: total coins staked (non-spendable until maturity)
 int64 CWallet::GetStake() const
 {
-    int64 nTotal = 0;
     LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    CacheBalances();
+    return nStakeCached;
 }
 
 int64 CWallet::GetImmatureBalance() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nImmatureBalanceCached;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -1008,33 +1492,44 @@ void CWallet::AvailableCoins(std::vector<COutput>& vCoins, unsigned int nSpendTi
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const CWalletTx* pcoinLast = NULL;
+        bool fUsable = false;
+        int nDepth = 0;
+        for (map<COutPoint, CWalletCoin>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const COutPoint& outpoint = (*it).first;
+            const CWalletTx* pcoin = (*it).second.ptx;
 
-            if (!pcoin->IsFinal())
-                continue;
+            // outputs of the same transaction are adjacent in the index
+            if (pcoin != pcoinLast)
+            {
+                pcoinLast = pcoin;
+                fUsable = false;
 
-            if (fOnlyConfirmed && !pcoin->IsConfirmed())
-                continue;
+                if (!pcoin->IsFinal())
+                    continue;
 
-            if (pcoin->nTime > nSpendTime)
-                continue;  // ppcoin: timestamp must not exceed spend time
+                if (fOnlyConfirmed && !pcoin->IsConfirmed())
+                    continue;
 
-            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+                if (pcoin->nTime > nSpendTime)
+                    continue;  // ppcoin: timestamp must not exceed spend time
+
+                if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
+                    continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                    vCoins.push_back(COutput(pcoin, i, pcoin->GetDepthInMainChain()));
+                fUsable = true;
+                nDepth = pcoin->GetDepthInMainChain();
             }
+
+            if (fUsable && !IsLockedCoin(outpoint.hash, outpoint.n) &&
+                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(outpoint.hash, outpoint.n)))
+                vCoins.push_back(COutput(pcoin, outpoint.n, nDepth));
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsigned int> > >vValue, int64 nTotalLower, int64 nTargetValue,
+static void ApproximateBestSubset(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTotalLower, int64 nTargetValue,
                                   vector<char>& vfBest, int64& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -1080,7 +1575,73 @@ static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsig
     }
 }
 
-bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
+// Branch and bound search for a subset of vValue (sorted by descending
+// value) that adds up to exactly nTargetValue, so that no change is needed.
+// Gives up after nMaxTries steps.
+static bool SelectCoinsBnB(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTargetValue,
+                           vector<char>& vfBest, int nMaxTries = 100000)
+{
+    unsigned int nSize = vValue.size();
+
+    // vRemaining[i] is the total value of the coins from i on
+    vector<int64> vRemaining(nSize + 1, 0);
+    for (unsigned int i = nSize; i-- > 0; )
+        vRemaining[i] = vRemaining[i + 1] + vValue[i].first;
+
+    vector<char> vfIncluded(nSize, false);
+    vector<unsigned int> vIncluded;
+    int64 nCurrent = 0;
+    unsigned int i = 0;
+
+    for (int nTries = 0; nTries < nMaxTries; nTries++)
+    {
+        if (nCurrent == nTargetValue)
+        {
+            vfBest = vfIncluded;
+            return true;
+        }
+
+        // Skip the coins too big to fit (a binary search, as values descend)
+        int64 nGap = nTargetValue - nCurrent;
+        unsigned int nEnd = nSize;
+        while (i < nEnd)
+        {
+            unsigned int nMid = (i + nEnd) / 2;
+            if (vValue[nMid].first > nGap)
+                i = nMid + 1;
+            else
+                nEnd = nMid;
+        }
+
+        if (vRemaining[i] < nGap)
+        {
+            // Can't reach the target from here: exclude the last included coin instead
+            if (vIncluded.empty())
+                return false; // the whole tree was searched
+            i = vIncluded.back();
+            vIncluded.pop_back();
+            vfIncluded[i] = false;
+            nCurrent -= vValue[i].first;
+            i++;
+        }
+        else if (i > 0 && !vfIncluded[i - 1] && vValue[i].first == vValue[i - 1].first)
+        {
+            // Including a coin equal to the one just excluded would only
+            // revisit the same sums
+            i++;
+        }
+        else
+        {
+            vfIncluded[i] = true;
+            vIncluded.push_back(i);
+            nCurrent += vValue[i].first;
+            i++;
+        }
+    }
+    return false;
+}
+
+bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
 {
     setCoinsRet.clear();
@@ -1093,9 +1654,13 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
     vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
     int64 nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    // Ties between coins of equal value are broken at random, as if the
+    // coins had been shuffled
+    pair<const CWalletTx*,unsigned int> coinExact(NULL, 0);
+    int nExact = 0;
+    int nLowestLarger = 0;
 
-    BOOST_FOREACH(COutput output, vCoins)
+    BOOST_FOREACH(const COutput& output, vCoins)
     {
         const CWalletTx *pcoin = output.tx;
 
@@ -1109,9 +1674,8 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
 
         if (n == nTargetValue)
         {
-            setCoinsRet.insert(coin.second);
-            nValueRet += coin.first;
-            return true;
+            if (GetRandInt(++nExact) == 0)
+                coinExact = coin.second;
         }
         else if (n < nTargetValue + CENT)
         {
@@ -1119,11 +1683,23 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
             nTotalLower += n;
         }
         else if (n < coinLowestLarger.first)
+        {
+            coinLowestLarger = coin;
+            nLowestLarger = 1;
+        }
+        else if (n == coinLowestLarger.first && GetRandInt(++nLowestLarger) == 0)
         {
             coinLowestLarger = coin;
         }
     }
 
+    if (coinExact.first)
+    {
+        setCoinsRet.insert(coinExact);
+        nValueRet += nTargetValue;
+        return true;
+    }
+
     if (nTotalLower == nTargetValue)
     {
         for (unsigned int i = 0; i < vValue.size(); ++i)
@@ -1143,14 +1719,22 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    // Shuffle, then sort by value: coins of equal value stay in random order
+    random_shuffle(vValue.begin(), vValue.end(), GetRandInt);
+    stable_sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     int64 nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    // An exact match needs no change, and beats any bigger coin
+    if (SelectCoinsBnB(vValue, nTargetValue, vfBest))
+        nBest = nTargetValue;
+    else
+    {
+        // Solve subset sum by stochastic approximation
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+        if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    }
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -1603,10 +2187,9 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
         LOCK2(cs_main, cs_wallet);
         printf("CommitTransaction:\n%s", wtxNew.ToString().c_str());
         {
-            // This is only to keep the database open to defeat the auto-flush for the
-            // duration of this scope.  This is the only place where this optimization
-            // maybe makes sense; please don't do it anywhere else.
-            CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile,"r") : NULL;
+            // Write the transaction, the spent coins and the key pool change
+            // as one database transaction
+            CWalletBatch batch(this);
 
             // Take key pair from key pool so it won't be used again
             reservekey.KeepKey();
@@ -1623,11 +2206,13 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateCoinIndex(coin);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
-            if (fFileBacked)
-                delete pwalletdb;
+            // Don't broadcast what the wallet file would not know about
+            if (!batch.Commit())
+                return error("CommitTransaction() : writing the transaction to the wallet failed");
         }
 
         // Track how many getdata requests our transaction gets
@@ -1720,11 +2305,17 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         }
     }
 
-    if (nLoadWalletRet != DB_LOAD_OK)
+    if (nLoadWalletRet != DB_LOAD_OK && nLoadWalletRet != DB_NONCRITICAL_ERROR)
         return nLoadWalletRet;
-    fFirstRunRet = !vchDefaultKey.IsValid();
+    if (nLoadWalletRet == DB_LOAD_OK)
+        fFirstRunRet = !vchDefaultKey.IsValid();
 
-    return DB_LOAD_OK;
+    // Startup carries on after noncritical errors with whatever was read,
+    // so the indices must cover it too
+    ReindexCoins();
+    ReindexTransactions();
+
+    return nLoadWalletRet;
 }
 
 DBErrors CWallet::ZapWalletTx()
@@ -1758,7 +2349,7 @@ bool CWallet::SetAddressBookName(const CTxDestination& address, const string& st
     NotifyAddressBookChanged(this, address, strName, ::IsMine(*this, address), (mi == mapAddressBook.end()) ? CT_NEW : CT_UPDATED);
     if (!fFileBacked)
         return false;
-    return CWalletDB(strWalletFile).WriteName(CBitcoinAddress(address).ToString(), strName);
+    return CWalletDBHandle(this)->WriteName(CBitcoinAddress(address).ToString(), strName);
 }
 
 bool CWallet::DelAddressBookName(const CTxDestination& address)
@@ -1767,7 +2358,7 @@ bool CWallet::DelAddressBookName(const CTxDestination& address)
     NotifyAddressBookChanged(this, address, "", ::IsMine(*this, address), CT_DELETED);
     if (!fFileBacked)
         return false;
-    return CWalletDB(strWalletFile).EraseName(CBitcoinAddress(address).ToString());
+    return CWalletDBHandle(this)->EraseName(CBitcoinAddress(address).ToString());
 }
 
 
@@ -1807,7 +2398,7 @@ bool CWallet::SetDefaultKey(const CPubKey &vchPubKey)
 {
     if (fFileBacked)
     {
-        if (!CWalletDB(strWalletFile).WriteDefaultKey(vchPubKey))
+        if (!CWalletDBHandle(this)->WriteDefaultKey(vchPubKey))
             return false;
     }
     vchDefaultKey = vchPubKey;
@@ -1830,9 +2421,9 @@ bool CWallet::NewKeyPool()
 {
     {
         LOCK(cs_wallet);
-        CWalletDB walletdb(strWalletFile);
+        CWalletDBHandle walletdb(this);
         BOOST_FOREACH(int64 nIndex, setKeyPool)
-            walletdb.ErasePool(nIndex);
+            walletdb->ErasePool(nIndex);
         setKeyPool.clear();
 
         if (IsLocked())
@@ -1842,7 +2433,7 @@ bool CWallet::NewKeyPool()
         for (int i = 0; i < nKeys; i++)
         {
             int64 nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
+            walletdb->WritePool(nIndex, CKeyPool(GenerateNewKey()));
             setKeyPool.insert(nIndex);
         }
         printf("CWallet::NewKeyPool wrote %" PRI64d" new keys\n", nKeys);
@@ -1850,32 +2441,94 @@ bool CWallet::NewKeyPool()
     return true;
 }
 
-bool CWallet::TopUpKeyPool()
+// Fill the key pool up to nSize keys (-keypool if 0). Keys are generated
+// in batches without holding cs_wallet, and each batch is written as one
+// database transaction.
+bool CWallet::TopUpKeyPool(unsigned int nSize)
 {
+    unsigned int nTargetSize = nSize ? nSize : max(GetArg("-keypool", 100), 0LL) + 1;
+    ploop
     {
-        LOCK(cs_wallet);
+        unsigned int nMissing;
+        bool fCompressed;
+        {
+            LOCK(cs_wallet);
+            if (IsLocked())
+                return false;
+            if (setKeyPool.size() >= nTargetSize)
+                break;
+            nMissing = std::min(nTargetSize - (unsigned int)setKeyPool.size(), 100u);
 
-        if (IsLocked())
-            return false;
+            // Compressed public keys were introduced in version 0.6.0
+            fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+            if (fCompressed)
+                SetMinVersion(FEATURE_COMPRPUBKEY);
+        }
 
-        CWalletDB walletdb(strWalletFile);
+        vector<CKey> vKeys(nMissing);
+        RandAddSeedPerfmon();
+        BOOST_FOREACH(CKey& key, vKeys)
+            key.MakeNewKey(fCompressed);
 
-        // Top up key pool
-        unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
-        while (setKeyPool.size() < (nTargetSize + 1))
         {
-            int64 nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
+            LOCK(cs_wallet);
+            if (IsLocked())
+                return false;
+
+            CWalletBatch batch(this);
+            CWalletDBHandle walletdb(this);
+            bool fWritten = true;
+            vector<int64> vAdded;
+            BOOST_FOREACH(const CKey& key, vKeys)
+            {
+                int64 nEnd = 1;
+                if (!setKeyPool.empty())
+                    nEnd = *(--setKeyPool.end()) + 1;
+                if (!(fWritten = walletdb->WritePool(nEnd, CKeyPool(AddNewKey(key)))))
+                    break;
+                setKeyPool.insert(nEnd);
+                vAdded.push_back(nEnd);
+            }
+            if (!batch.Commit())
+            {
+                // none of the pool entries made it to disk
+                BOOST_FOREACH(int64 nIndex, vAdded)
+                    setKeyPool.erase(nIndex);
+                throw runtime_error("TopUpKeyPool() : committing generated keys failed");
+            }
+            if (!fWritten)
                 throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            printf("keypool added key %" PRI64d", size=%" PRIszu"\n", nEnd, setKeyPool.size());
+            printf("keypool added %u keys, size=%" PRIszu"\n", nMissing, setKeyPool.size());
         }
     }
     return true;
 }
 
+void CWallet::RequestKeyPoolTopUp()
+{
+    boost::unique_lock<boost::mutex> lock(mutexKeyPoolTopUp);
+    fKeyPoolTopUpRequested = true;
+    condKeyPoolTopUp.notify_one();
+}
+
+void ThreadKeyPoolTopUp(CWallet* pwallet)
+{
+    // Make this thread recognisable as the key-topping-up thread
+    RenameThread("peercoin-key-top");
+
+    ploop
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(pwallet->mutexKeyPoolTopUp);
+            // Also top up now and then, e.g. after the wallet is unlocked
+            if (!pwallet->fKeyPoolTopUpRequested)
+                pwallet->condKeyPoolTopUp.timed_wait(lock, boost::posix_time::seconds(60));
+            pwallet->fKeyPoolTopUpRequested = false;
+        }
+        pwallet->TopUpKeyPool();
+    }
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -1883,18 +2536,27 @@ void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
+        // Only make the caller wait for key generation if the pool is
+        // empty; otherwise it is topped up in the background. Inside a
+        // batch, the new keys are written to the batch and read back from
+        // it below.
         if (!IsLocked())
-            TopUpKeyPool();
+        {
+            if (setKeyPool.empty())
+                TopUpKeyPool(1);
+            if ((int64)setKeyPool.size() <= GetArg("-keypool", 100))
+                RequestKeyPoolTopUp();
+        }
 
         // Get the oldest key
         if(setKeyPool.empty())
             return;
 
-        CWalletDB walletdb(strWalletFile);
+        CWalletDBHandle walletdb(this);
 
         nIndex = *(setKeyPool.begin());
         setKeyPool.erase(setKeyPool.begin());
-        if (!walletdb.ReadPool(nIndex, keypool))
+        if (!walletdb->ReadPool(nIndex, keypool))
             throw runtime_error("ReserveKeyFromKeyPool() : read failed");
         if (!HaveKey(keypool.vchPubKey.GetID()))
             throw runtime_error("ReserveKeyFromKeyPool() : unknown key in key pool");
@@ -1908,10 +2570,8 @@ int64 CWallet::AddReserveKey(const CKeyPool& keypool)
 {
     {
         LOCK2(cs_main, cs_wallet);
-        CWalletDB walletdb(strWalletFile);
-
         int64 nIndex = 1 + *(--setKeyPool.end());
-        if (!walletdb.WritePool(nIndex, keypool))
+        if (!CWalletDBHandle(this)->WritePool(nIndex, keypool))
             throw runtime_error("AddReserveKey() : writing added key failed");
         setKeyPool.insert(nIndex);
         return nIndex;
@@ -1924,8 +2584,7 @@ void CWallet::KeepKey(int64 nIndex)
     // Remove from key pool
     if (fFileBacked)
     {
-        CWalletDB walletdb(strWalletFile);
-        walletdb.ErasePool(nIndex);
+        CWalletDBHandle(this)->ErasePool(nIndex);
     }
     printf("keypool keep %" PRI64d"\n", nIndex);
 }
@@ -2008,6 +2667,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64& nBalanceInQuestion, bool
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    UpdateCoinIndex(*pcoin);
                 }
             }
             else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && !coins.IsAvailable(n))
@@ -2020,6 +2680,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64& nBalanceInQuestion, bool
                 {
                     pcoin->MarkSpent(n);
                     pcoin->WriteToDisk();
+                    UpdateCoinIndex(*pcoin);
                 }
             }
         }
@@ -2043,6 +2704,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                UpdateCoinIndex(prev);
             }
         }
     }
@@ -2054,34 +2716,28 @@ std::map<CTxDestination, int64> CWallet::GetAddressBalances()
 
     {
         LOCK(cs_wallet);
-        BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
+        const CWalletTx* pcoinLast = NULL;
+        bool fUsable = false;
+        for (map<COutPoint, CWalletCoin>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it)
         {
-            CWalletTx *pcoin = &walletEntry.second;
-
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                continue;
+            const CWalletCoin& coin = (*it).second;
+            const CWalletTx* pcoin = coin.ptx;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+            if (pcoin != pcoinLast)
+            {
+                pcoinLast = pcoin;
+                fUsable = pcoin->IsFinal() && pcoin->IsConfirmed() &&
+                          !(pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0) &&
+                          pcoin->GetDepthInMainChain() >= (pcoin->IsFromMe() ? 0 : 1);
+            }
+            if (!fUsable)
                 continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < (pcoin->IsFromMe() ? 0 : 1))
+            CTxDestination addr;
+            if(!ExtractDestination(pcoin->vout[coin.n].scriptPubKey, addr))
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-            {
-                CTxDestination addr;
-                if (!IsMine(pcoin->vout[i]))
-                    continue;
-                if(!ExtractDestination(pcoin->vout[i].scriptPubKey, addr))
-                    continue;
-
-                int64 n = pcoin->IsSpent(i) ? 0 : pcoin->vout[i].nValue;
-
-                if (!balances.count(addr))
-                    balances[addr] = 0;
-                balances[addr] += n;
-            }
+            balances[addr] += coin.nValue;
         }
     }
 
@@ -11,6 +11,8 @@
 
 #include <stdlib.h>
 
+#include <boost/thread/condition_variable.hpp>
+
 #include "main.h"
 #include "key.h"
 #include "keystore.h"
@@ -66,6 +68,30 @@ public:
     )
 };
 
+/** An unspent output of ours, as tracked by the wallet coin index.
+ * The transaction pointer refers into mapWallet and is only valid while cs_wallet is held.
+ */
+class CWalletCoin
+{
+public:
+    const CWalletTx* ptx;
+    unsigned int n;
+    int64 nValue;
+    bool fCoinBase;
+    bool fCoinStake;
+
+    CWalletCoin()
+    {
+        ptx = NULL;
+        n = 0;
+        nValue = 0;
+        fCoinBase = false;
+        fCoinStake = false;
+    }
+
+    CWalletCoin(const CWalletTx* ptxIn, unsigned int nIn);
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -76,12 +102,30 @@ private:
 
     CWalletDB *pwalletdbEncryption;
 
+    // open batch of database writes, see BeginBatch()
+    CWalletDB *pwalletdbBatch;
+    int nBatchDepth;
+    boost::thread::id idBatchThread;
+
     // the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // memory only: balance totals derived from mapCoins, valid while the
+    // best chain and the coin index are unchanged since they were computed.
+    // They are recomputed in one pass over mapCoins rather than updated per
+    // coin: whether a coin is confirmed or mature depends on the best chain,
+    // so every new block would change them anyway.
+    mutable uint256 hashBalancesBestChain;
+    mutable int64 nBalancesCoinIndexVersion;
+    mutable int64 nBalanceCached;
+    mutable int64 nUnconfirmedBalanceCached;
+    mutable int64 nImmatureBalanceCached;
+    mutable int64 nStakeCached;
+    void CacheBalances() const;
+
 public:
     mutable CCriticalSection cs_wallet;
 
@@ -102,7 +146,20 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbBatch = NULL;
+        nBatchDepth = 0;
         nOrderPosNext = 0;
+        nCoinIndexVersion = 0;
+        nBalancesCoinIndexVersion = -1;
+        nTimeFirstKey = 0;
+        fScanningWallet = false;
+        fAbortRescan = false;
+        nScanStartHeight = nScanHeight = nScanEndHeight = 0;
+        nScanStartTime = 0;
+        fBackingUp = false;
+        nBackupRecords = nBackupRecordsTotal = 0;
+        nBackupBytes = nBackupStartTime = 0;
+        fKeyPoolTopUpRequested = false;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -112,11 +169,55 @@ public:
         fFileBacked = true;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbBatch = NULL;
+        nBatchDepth = 0;
         nOrderPosNext = 0;
+        nCoinIndexVersion = 0;
+        nBalancesCoinIndexVersion = -1;
+        nTimeFirstKey = 0;
+        fScanningWallet = false;
+        fAbortRescan = false;
+        nScanStartHeight = nScanHeight = nScanEndHeight = 0;
+        nScanStartTime = 0;
+        fBackingUp = false;
+        nBackupRecords = nBackupRecordsTotal = 0;
+        nBackupBytes = nBackupStartTime = 0;
+        fKeyPoolTopUpRequested = false;
     }
 
+    std::map<CKeyID, CKeyMetadata> mapKeyMetadata;
+
+    // earliest key creation time: blocks older than this cannot pay to the
+    // wallet (0 if there are no keys, 1 if some key's age is unknown)
+    int64 nTimeFirstKey;
+
+    // progress of the running ScanForWalletTransactions, if any
+    volatile bool fScanningWallet;
+    volatile bool fAbortRescan;
+    volatile int nScanStartHeight;
+    volatile int nScanHeight;
+    volatile int nScanEndHeight;
+    volatile int64 nScanStartTime;
+
+    // progress of the running BackupWallet, if any
+    volatile bool fBackingUp;
+    volatile int nBackupRecords;
+    volatile int nBackupRecordsTotal;
+    volatile int64 nBackupBytes;
+    volatile int64 nBackupStartTime;
+
+    // wakes ThreadKeyPoolTopUp, see RequestKeyPoolTopUp()
+    boost::mutex mutexKeyPoolTopUp;
+    boost::condition_variable condKeyPoolTopUp;
+    bool fKeyPoolTopUpRequested;
+
     std::map<uint256, CWalletTx> mapWallet;
     int64 nOrderPosNext;
+
+    // index of our unspent outputs in mapWallet, so that balance and coin
+    // selection do not have to walk every wallet transaction
+    std::map<COutPoint, CWalletCoin> mapCoins;
+    int64 nCoinIndexVersion;
     std::map<uint256, int> mapRequestCount;
 
     std::map<CTxDestination, std::string> mapAddressBook;
@@ -129,7 +230,7 @@ public:
     bool CanSupportFeature(enum WalletFeature wf) { return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, unsigned int nSpendTime, bool fOnlyConfirmed = true, const CCoinControl *coinControl=NULL) const;
-    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
     bool IsLockedCoin(uint256 hash, unsigned int n) const;
     void LockCoin(COutPoint& output);
     void UnlockCoin(COutPoint& output);
@@ -139,10 +240,15 @@ public:
     // keystore implementation
     // Generate a new key
     CPubKey GenerateNewKey();
+    // Adds a newly generated key with its creation time (requires cs_wallet)
+    CPubKey AddNewKey(const CKey& key);
     // Adds a key to the store, and saves it to disk.
     bool AddKey(const CKey& key);
     // Adds a key to the store, without saving it to disk (used by LoadWallet)
     bool LoadKey(const CKey& key) { return CCryptoKeyStore::AddKey(key); }
+    // Load metadata (used by LoadWallet)
+    bool LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &metadata);
+    void UpdateTimeFirstKey(int64 nCreateTime);
 
     bool LoadMinVersion(int nVersion) { nWalletVersion = nVersion; nWalletMaxVersion = std::max(nWalletMaxVersion, nVersion); return true; }
 
@@ -153,6 +259,13 @@ public:
     bool AddCScript(const CScript& redeemScript);
     bool LoadCScript(const CScript& redeemScript) { return CCryptoKeyStore::AddCScript(redeemScript); }
 
+    // Group the wallet database writes of the calling thread into one
+    // database transaction until the matching CommitBatch(); holds cs_wallet
+    // in between. Batches nest.
+    void BeginBatch();
+    bool CommitBatch();
+    CWalletDB* GetBatchDB() const;
+
     bool Unlock(const SecureString& strWalletPassphrase);
     bool ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase, const SecureString& strNewWalletPassphrase);
     bool EncryptWallet(const SecureString& strWalletPassphrase);
@@ -165,13 +278,31 @@ public:
     typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
     typedef std::multimap<int64, TxPair > TxItems;
 
+    // memory only: all accounting entries, and the wallet's activity log
+    // (transactions and accounting entries) ordered by nOrderPos
+    std::list<CAccountingEntry> laccentries;
+    TxItems wtxOrdered;
+
+    // memory only: wallet transactions by the height of the block they were
+    // confirmed in, or -1 if unconfirmed or disconnected from the main chain
+    std::multimap<int, CWalletTx*> mapTxByHeight;
+
     /** Get the wallet's activity log
         @return multimap of ordered transactions and accounting entries
-        @warning Returned pointers are *only* valid within the scope of passed acentries
+        @note Requires cs_wallet; pointers are valid while it is held.
      */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    const TxItems& OrderedTxItems() const { return wtxOrdered; }
+
+    // Adds an accounting entry that has been written to disk to the activity log
+    void AddAccountingEntry(const CAccountingEntry& acentry);
+    int64 GetAccountCreditDebit(const std::string& strAccount) const;
 
     void MarkDirty();
+    void UpdateCoinIndex(const CWalletTx& wtx);
+    void ReindexCoins();
+    void UpdateHeightIndex(CWalletTx& wtx, bool fInMainChain = true);
+    void ReindexTransactions();
+    void DisconnectedTransaction(const uint256& hashTx);
     bool AddToWallet(const CWalletTx& wtxIn);
     bool AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
     bool EraseFromWallet(uint256 hash);
@@ -194,7 +325,9 @@ public:
     std::string SendMoneyToDestination(const CTxDestination &address, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
 
     bool NewKeyPool();
-    bool TopUpKeyPool();
+    bool TopUpKeyPool(unsigned int nSize = 0);
+    // Ask ThreadKeyPoolTopUp to refill the key pool
+    void RequestKeyPoolTopUp();
     int64 AddReserveKey(const CKeyPool& keypool);
     void ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool);
     void KeepKey(int64 nIndex);
@@ -348,6 +481,37 @@ public:
     void KeepKey();
 };
 
+/** A batch of wallet database writes, see CWallet::BeginBatch(). Leaving
+ * the scope without Commit(), e.g. on an exception, commits what was
+ * written so far. */
+class CWalletBatch
+{
+private:
+    CWallet* pwallet;
+    bool fOpen;
+
+    CWalletBatch(const CWalletBatch&);
+    CWalletBatch& operator=(const CWalletBatch&);
+
+public:
+    explicit CWalletBatch(CWallet* pwalletIn) : pwallet(pwalletIn), fOpen(true)
+    {
+        pwallet->BeginBatch();
+    }
+
+    ~CWalletBatch()
+    {
+        if (fOpen)
+            pwallet->CommitBatch();
+    }
+
+    bool Commit()
+    {
+        fOpen = false;
+        return pwallet->CommitBatch();
+    }
+};
+
 
 typedef std::map<std::string, std::string> mapValue_t;
 
@@ -392,6 +556,7 @@ public:
     int64 nOrderPos;  // position in ordered transaction list
 
     // memory only
+    int nHeightIndexed; // key in CWallet::mapTxByHeight, or -2 if not indexed
     mutable bool fDebitCached;
     mutable bool fCreditCached;
     mutable bool fImmatureCreditCached;
@@ -446,6 +611,7 @@ public:
         nAvailableCreditCached = 0;
         nChangeCached = 0;
         nOrderPos = -1;
+        nHeightIndexed = -2;
     }
 
     IMPLEMENT_SERIALIZE
@@ -881,5 +1047,6 @@ private:
 };
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
+void ThreadKeyPoolTopUp(CWallet* pwallet);
 
 #endif
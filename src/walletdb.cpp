@@ -77,10 +77,10 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
     ploop
     {
         // Read next record
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CSecureDataStream ssKey(SER_DISK, CLIENT_VERSION);
         if (fFlags == DB_SET_RANGE)
             ssKey << boost::make_tuple(string("acentry"), (fAllAccounts? string("") : strAccount), uint64(0));
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        CSecureDataStream ssValue(SER_DISK, CLIENT_VERSION);
         int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
         fFlags = DB_NEXT;
         if (ret == DB_NOTFOUND)
@@ -183,8 +183,72 @@ CWalletDB::ReorderTransactions(CWallet* pwallet)
 }
 
 
+// Deserialize and check a wallet transaction record.
+// Only touches wtx, so records can be read by several threads at once.
+static bool ReadWalletTx(CWallet* pwallet, const uint256& hash, CSecureDataStream& ssValue,
+                         CWalletTx& wtx, bool& fUpgraded, string& strErr)
+{
+    ssValue >> wtx;
+    CValidationState state;
+    if (!(wtx.CheckTransaction(state) && (wtx.GetHash() == hash) && state.IsValid()))
+        return false;
+    wtx.BindWallet(pwallet);
+
+    // Undo serialize changes in 31600
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgraded = true;
+    }
+    return true;
+}
+
+// A wallet transaction record, read sequentially from the cursor and
+// deserialized by ThreadReadWalletTxs
+struct CWalletTxRecord
+{
+    uint256 hash;
+    CSecureDataStream ssValue;
+    CWalletTx* pwtx;
+    bool fValid;
+    bool fUpgraded;
+    string strErr;
+
+    CWalletTxRecord(const uint256& hashIn, const CSecureDataStream& ssValueIn, CWalletTx* pwtxIn) :
+        hash(hashIn), ssValue(ssValueIn), pwtx(pwtxIn), fValid(false), fUpgraded(false)
+    {
+    }
+};
+
+static void ThreadReadWalletTxs(CWallet* pwallet, vector<CWalletTxRecord>* pvRecords, unsigned int nFirst, unsigned int nStep)
+{
+    for (unsigned int i = nFirst; i < pvRecords->size(); i += nStep)
+    {
+        CWalletTxRecord& record = (*pvRecords)[i];
+        try {
+            record.fValid = ReadWalletTx(pwallet, record.hash, record.ssValue, *record.pwtx, record.fUpgraded, record.strErr);
+        }
+        catch (...) {
+            record.fValid = false;
+        }
+    }
+}
+
 bool
-ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
+ReadKeyValue(CWallet* pwallet, CSecureDataStream& ssKey, CSecureDataStream& ssValue,
              int& nFileVersion, vector<uint256>& vWalletUpgrade,
              bool& fIsEncrypted,  bool& fAnyUnordered, string& strType, string& strErr)
 {
@@ -204,35 +268,14 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             uint256 hash;
             ssKey >> hash;
             CWalletTx& wtx = pwallet->mapWallet[hash];
-            ssValue >> wtx;
-            CValidationState state;
-            if (wtx.CheckTransaction(state) && (wtx.GetHash() == hash) && state.IsValid())
-                wtx.BindWallet(pwallet);
-            else
+            bool fUpgraded = false;
+            if (!ReadWalletTx(pwallet, hash, ssValue, wtx, fUpgraded, strErr))
             {
                 pwallet->mapWallet.erase(hash);
                 return false;
             }
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
+            if (fUpgraded)
                 vWalletUpgrade.push_back(hash);
-            }
 
             if (wtx.nOrderPos == -1)
                 fAnyUnordered = true;
@@ -343,6 +386,14 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             }
             fIsEncrypted = true;
         }
+        else if (strType == "keymeta")
+        {
+            vector<unsigned char> vchPubKey;
+            ssKey >> vchPubKey;
+            CKeyMetadata keyMeta;
+            ssValue >> keyMeta;
+            pwallet->LoadKeyMetadata(CPubKey(vchPubKey), keyMeta);
+        }
         else if (strType == "defaultkey")
         {
             ssValue >> pwallet->vchDefaultKey;
@@ -388,6 +439,19 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+// Keep accounting entries in memory for the wallet's activity log
+static bool LoadAccountingEntries(CWalletDB& walletdb, CWallet* pwallet)
+{
+    pwallet->laccentries.clear();
+    try {
+        walletdb.ListAccountCreditDebit("*", pwallet->laccentries);
+    }
+    catch (std::exception &e) {
+        return false;
+    }
+    return true;
+}
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -397,6 +461,8 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
     bool fAnyUnordered = false;
     bool fNoncriticalErrors = false;
     DBErrors result = DB_LOAD_OK;
+    vector<CWalletTxRecord> vTxRecords;
+    map<string, pair<int, int64> > mapLoadTime; // record count and microseconds per type
 
     try {
         LOCK(pwallet->cs_wallet);
@@ -419,8 +485,8 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         ploop
         {
             // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            CSecureDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CSecureDataStream ssValue(SER_DISK, CLIENT_VERSION);
             int ret = ReadAtCursor(pcursor, ssKey, ssValue);
             if (ret == DB_NOTFOUND)
                 break;
@@ -430,10 +496,30 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 return DB_CORRUPT;
             }
 
-            // Try to be tolerant of single corrupt records:
             string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, nFileVersion,
-                              vWalletUpgrade, fIsEncrypted, fAnyUnordered, strType, strErr))
+            {
+                CSecureDataStream ssType(ssKey);
+                ssType >> strType;
+            }
+            int64 nStart = GetTimeMicros();
+
+            // Wallet transactions are deserialized in parallel below
+            if (strType == "tx")
+            {
+                uint256 hash;
+                ssKey >> strType >> hash;
+                vTxRecords.push_back(CWalletTxRecord(hash, ssValue, &pwallet->mapWallet[hash]));
+                mapLoadTime[strType].first++;
+                mapLoadTime[strType].second += GetTimeMicros() - nStart;
+                continue;
+            }
+
+            // Try to be tolerant of single corrupt records:
+            bool fRead = ReadKeyValue(pwallet, ssKey, ssValue, nFileVersion,
+                                      vWalletUpgrade, fIsEncrypted, fAnyUnordered, strType, strErr);
+            mapLoadTime[strType].first++;
+            mapLoadTime[strType].second += GetTimeMicros() - nStart;
+            if (!fRead)
             {
                 // losing keys is considered a catastrophic error, anything else
                 // we assume the user can live with:
@@ -452,6 +538,40 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 printf("%s\n", strErr.c_str());
         }
         pcursor->close();
+
+        int64 nStart = GetTimeMicros();
+        unsigned int nThreads = std::min(std::max(boost::thread::hardware_concurrency(), 1u), 8u);
+        if (vTxRecords.size() < 100)
+            nThreads = 1;
+        boost::thread_group threadGroup;
+        for (unsigned int i = 1; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&ThreadReadWalletTxs, pwallet, &vTxRecords, i, nThreads));
+        ThreadReadWalletTxs(pwallet, &vTxRecords, 0, nThreads);
+        threadGroup.join_all();
+
+        BOOST_FOREACH(const CWalletTxRecord& record, vTxRecords)
+        {
+            if (!record.fValid)
+            {
+                pwallet->mapWallet.erase(record.hash);
+                fNoncriticalErrors = true;
+                // Rescan if there is a bad transaction record:
+                SoftSetBoolArg("-rescan", true);
+            }
+            else
+            {
+                if (record.fUpgraded)
+                    vWalletUpgrade.push_back(record.hash);
+                if (record.pwtx->nOrderPos == -1)
+                    fAnyUnordered = true;
+            }
+            if (!record.strErr.empty())
+                printf("%s\n", record.strErr.c_str());
+        }
+        mapLoadTime["tx"].second += GetTimeMicros() - nStart;
+
+        for (map<string, pair<int, int64> >::iterator it = mapLoadTime.begin(); it != mapLoadTime.end(); ++it)
+            printf("LoadWallet() : %7d %-12s records %8.2fms\n", (*it).second.first, (*it).first.c_str(), (*it).second.second * 0.001);
     }
     catch (boost::thread_interrupted) {
         throw;
@@ -463,10 +583,29 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
     if (fNoncriticalErrors && result == DB_LOAD_OK)
         result = DB_NONCRITICAL_ERROR;
 
+    // Keys written before creation times were recorded could be of any age.
+    // Check even after load errors: a wallet that is used anyway must not
+    // skip blocks on a rescan.
+    {
+        set<CKeyID> setKeys;
+        pwallet->GetKeys(setKeys);
+        BOOST_FOREACH(const CKeyID& keyid, setKeys)
+            if (!pwallet->mapKeyMetadata.count(keyid))
+            {
+                pwallet->UpdateTimeFirstKey(0);
+                break;
+            }
+    }
+
     // Any wallet corruption at all: skip any rewriting or
     // upgrading, we don't want to make it worse.
     if (result != DB_LOAD_OK)
+    {
+        // init still uses a wallet with noncritical errors
+        if (result == DB_NONCRITICAL_ERROR && !LoadAccountingEntries(*this, pwallet))
+            return DB_CORRUPT;
         return result;
+    }
 
     printf("nFileVersion = %d\n", nFileVersion);
 
@@ -483,6 +622,9 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
     if (fAnyUnordered)
         result = ReorderTransactions(pwallet);
 
+    if (!LoadAccountingEntries(*this, pwallet))
+        return DB_CORRUPT;
+
     return result;
 }
 
@@ -513,8 +655,8 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash)
         while (true)
         {
             // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            CSecureDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CSecureDataStream ssValue(SER_DISK, CLIENT_VERSION);
             int ret = ReadAtCursor(pcursor, ssKey, ssValue);
             if (ret == DB_NOTFOUND)
                 break;
@@ -593,79 +735,204 @@ void ThreadFlushWalletDB(const string& strFile)
         if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
         {
             TRY_LOCK(bitdb.cs_db,lockDb);
-            if (lockDb)
+            if (lockDb && bitdb.mapFileUseCount.count(strFile))
             {
-                // Don't do this if any databases are in use
-                int nRefCount = 0;
-                map<string, int>::iterator mi = bitdb.mapFileUseCount.begin();
-                while (mi != bitdb.mapFileUseCount.end())
+                boost::this_thread::interruption_point();
+                printf("%s ", DateTimeStrFormat(GetTime()).c_str());
+                printf("Flushing wallet.dat\n");
+                nLastFlushed = nWalletDBUpdated;
+                int64 nStart = GetTimeMillis();
+
+                // Write the logged changes to wallet.dat, keeping the handle
+                // open; it is closed and made self-contained on shutdown
+                // and for backups only
+                bitdb.Checkpoint();
+
+                printf("Flushed wallet.dat %" PRI64d"ms\n", GetTimeMillis() - nStart);
+            }
+        }
+    }
+}
+
+// Copy the wallet database to the standalone file strFileDest while the
+// wallet stays in use: records are copied in chunks, holding cs_wallet for
+// one chunk at a time, and the records written meanwhile are copied again
+// at the end so that the copy is a consistent snapshot.
+bool CWalletDB::Backup(CWallet* pwallet, const string& strFileDest)
+{
+    static const unsigned int nChunkSize = 1000;
+
+    Db* pdbCopy = new Db(NULL, DB_CXX_NO_EXCEPTIONS);
+    int ret = pdbCopy->open(NULL,                 // Txn pointer
+                            strFileDest.c_str(),  // Filename
+                            "main",    // Logical db name
+                            DB_BTREE,  // Database type
+                            DB_CREATE,    // Flags
+                            0);
+    if (ret != 0)
+    {
+        printf("Cannot create database file %s\n", strFileDest.c_str());
+        delete pdbCopy;
+        return false;
+    }
+
+    DB_BTREE_STAT* pstat = NULL;
+    if (pdb->stat(NULL, &pstat, DB_FAST_STAT) == 0 && pstat)
+    {
+        pwallet->nBackupRecordsTotal = pstat->bt_ndata;
+        free(pstat);
+    }
+
+    {
+        // Writes done before this point are committed, see BeginBatch()
+        LOCK(pwallet->cs_wallet);
+        bitdb.BeginBackup(strFile);
+    }
+
+    bool fSuccess = true;
+    bool fDone = false;
+    std::vector<unsigned char> vchLastKey;
+    while (fSuccess && !fDone)
+    {
+        std::vector<CDBEnv::KeyValPair> vRecords;
+        {
+            LOCK(pwallet->cs_wallet);
+            Dbc* pcursor = GetCursor();
+            if (!pcursor)
+            {
+                fSuccess = false;
+                break;
+            }
+            // Resume after the last record copied
+            CSecureDataStream ssKey(vchLastKey, SER_DISK, CLIENT_VERSION);
+            CSecureDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            unsigned int fFlags = vchLastKey.empty() ? DB_NEXT : DB_SET_RANGE;
+            while (vRecords.size() < nChunkSize)
+            {
+                int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+                fFlags = DB_NEXT;
+                if (ret == DB_NOTFOUND)
                 {
-                    nRefCount += (*mi).second;
-                    mi++;
+                    fDone = true;
+                    break;
                 }
-
-                if (nRefCount == 0)
+                else if (ret != 0)
                 {
-                    boost::this_thread::interruption_point();
-                    map<string, int>::iterator mi = bitdb.mapFileUseCount.find(strFile);
-                    if (mi != bitdb.mapFileUseCount.end())
-                    {
-                        printf("%s ", DateTimeStrFormat(GetTime()).c_str());
-                        printf("Flushing wallet.dat\n");
-                        nLastFlushed = nWalletDBUpdated;
-                        int64 nStart = GetTimeMillis();
-
-                        // Flush wallet.dat so it's self contained
-                        bitdb.CloseDb(strFile);
-                        bitdb.CheckpointLSN(strFile);
-
-                        bitdb.mapFileUseCount.erase(mi++);
-                        printf("Flushed wallet.dat %" PRI64d"ms\n", GetTimeMillis() - nStart);
-                    }
+                    fSuccess = false;
+                    break;
                 }
+                std::vector<unsigned char> vchKey(ssKey.begin(), ssKey.end());
+                if (vchKey == vchLastKey)
+                    continue;
+                vRecords.push_back(make_pair(vchKey, std::vector<unsigned char>(ssValue.begin(), ssValue.end())));
+            }
+            pcursor->close();
+        }
+
+        BOOST_FOREACH(CDBEnv::KeyValPair& row, vRecords)
+        {
+            Dbt datKey(&row.first[0], row.first.size());
+            Dbt datValue(&row.second[0], row.second.size());
+            if (pdbCopy->put(NULL, &datKey, &datValue, 0) != 0)
+                fSuccess = false;
+            pwallet->nBackupBytes += row.first.size() + row.second.size();
+
+            // Clear memory in case it was a private key
+            memset(&row.second[0], 0, row.second.size());
+        }
+        if (!vRecords.empty())
+            vchLastKey = vRecords.back().first;
+        pwallet->nBackupRecords += vRecords.size();
+    }
+
+    {
+        LOCK(pwallet->cs_wallet);
+        std::set<std::vector<unsigned char> > setDirty;
+        bitdb.EndBackup(strFile, setDirty);
+
+        Dbc* pcursor = fSuccess ? GetCursor() : NULL;
+        if (fSuccess && !pcursor)
+            fSuccess = false;
+        BOOST_FOREACH(const std::vector<unsigned char>& vchKey, setDirty)
+        {
+            if (!fSuccess)
+                break;
+            CSecureDataStream ssKey(vchKey, SER_DISK, CLIENT_VERSION);
+            CSecureDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = ReadAtCursor(pcursor, ssKey, ssValue, DB_SET);
+            Dbt datKey((void*)&vchKey[0], vchKey.size());
+            if (ret == DB_NOTFOUND)
+            {
+                ret = pdbCopy->del(NULL, &datKey, 0);
+                if (ret != 0 && ret != DB_NOTFOUND)
+                    fSuccess = false;
+            }
+            else if (ret == 0)
+            {
+                Dbt datValue(&ssValue[0], ssValue.size());
+                if (pdbCopy->put(NULL, &datKey, &datValue, 0) != 0)
+                    fSuccess = false;
+                memset(&ssValue[0], 0, ssValue.size());
             }
+            else
+                fSuccess = false;
         }
+        if (pcursor)
+            pcursor->close();
+        if (fSuccess)
+            printf("Backup of %s: %" PRIszu" records changed while copying\n", strFile.c_str(), setDirty.size());
     }
+
+    if (pdbCopy->close(0))
+        fSuccess = false;
+    delete pdbCopy;
+    return fSuccess;
 }
 
-bool BackupWallet(const CWallet& wallet, const string& strDest)
+bool BackupWallet(CWallet& wallet, const string& strDest)
 {
     if (!wallet.fFileBacked)
         return false;
-    while (true)
-    {
+
+    // One backup at a time
+    static CCriticalSection cs_backupwallet;
+    LOCK(cs_backupwallet);
+
+    filesystem::path pathDest(strDest);
+    if (filesystem::is_directory(pathDest))
+        pathDest /= wallet.strWalletFile;
+    filesystem::path pathTemp = pathDest.string() + ".tmp";
+
+    wallet.nBackupRecords = wallet.nBackupRecordsTotal = 0;
+    wallet.nBackupBytes = 0;
+    wallet.nBackupStartTime = GetTime();
+    wallet.fBackingUp = true;
+
+    bool fSuccess = false;
+    try {
+        filesystem::remove(pathTemp);
         {
-            LOCK(bitdb.cs_db);
-            if (!bitdb.mapFileUseCount.count(wallet.strWalletFile) || bitdb.mapFileUseCount[wallet.strWalletFile] == 0)
-            {
-                // Flush log data to the dat file
-                bitdb.CloseDb(wallet.strWalletFile);
-                bitdb.CheckpointLSN(wallet.strWalletFile);
-                bitdb.mapFileUseCount.erase(wallet.strWalletFile);
-
-                // Copy wallet.dat
-                filesystem::path pathSrc = GetDataDir() / wallet.strWalletFile;
-                filesystem::path pathDest(strDest);
-                if (filesystem::is_directory(pathDest))
-                    pathDest /= wallet.strWalletFile;
-
-                try {
-#if BOOST_VERSION >= 104000
-                    filesystem::copy_file(pathSrc, pathDest, filesystem::copy_option::overwrite_if_exists);
-#else
-                    filesystem::copy_file(pathSrc, pathDest);
-#endif
-                    printf("copied wallet.dat to %s\n", pathDest.string().c_str());
-                    return true;
-                } catch(const filesystem::filesystem_error &e) {
-                    printf("error copying wallet.dat to %s - %s\n", pathDest.string().c_str(), e.what());
-                    return false;
-                }
-            }
+            CWalletDB walletdb(wallet.strWalletFile, "r");
+            fSuccess = walletdb.Backup(&wallet, pathTemp.string());
+        }
+        if (fSuccess)
+        {
+            filesystem::remove(pathDest);
+            filesystem::rename(pathTemp, pathDest);
+            printf("copied wallet.dat to %s in %" PRI64d"s\n", pathDest.string().c_str(), GetTime() - wallet.nBackupStartTime);
+        }
+        else
+        {
+            filesystem::remove(pathTemp);
+            printf("error copying wallet.dat to %s\n", pathDest.string().c_str());
         }
-        MilliSleep(100);
+    } catch(const filesystem::filesystem_error &e) {
+        printf("error copying wallet.dat to %s - %s\n", pathDest.string().c_str(), e.what());
+        fSuccess = false;
     }
-    return false;
+
+    wallet.fBackingUp = false;
+    return fSuccess;
 }
 
 //
@@ -726,8 +993,8 @@ bool CWalletDB::Recover(CDBEnv& dbenv, std::string filename, bool fOnlyKeys)
     {
         if (fOnlyKeys)
         {
-            CDataStream ssKey(row.first, SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(row.second, SER_DISK, CLIENT_VERSION);
+            CSecureDataStream ssKey(row.first, SER_DISK, CLIENT_VERSION);
+            CSecureDataStream ssValue(row.second, SER_DISK, CLIENT_VERSION);
             string strType, strErr;
             bool fReadOK = ReadKeyValue(&dummyWallet, ssKey, ssValue,
                                         nFileVersion, vWalletUpgrade,